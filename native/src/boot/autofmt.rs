@@ -0,0 +1,232 @@
+use crate::check_env;
+use crate::compress::{compress_vec, get_encoder};
+use crate::ffi::FileFormat;
+use crate::parallel::{par_map_workers, thread_count, with_worker_threads};
+use base::ResultExt;
+use std::cmp::max;
+use std::env;
+use std::io::{Error, Write};
+use std::mem::take;
+use std::str::FromStr;
+use std::sync::Mutex;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+// Automatic ramdisk compression, enabled by MAGISKBOOT_RAMDISK_AUTO=true.
+//
+// Every candidate format in MAGISKBOOT_RAMDISK_FORMATS is tried in parallel.
+// Without a size budget, the smallest output wins. With a budget set in
+// MAGISKBOOT_RAMDISK_BUDGET, the candidate that is the fastest to decompress
+// among those that fit wins, and the smallest one if none of them fit.
+//
+// Without MAGISKBOOT_RAMDISK_FORMATS, only the original format of the ramdisk,
+// LZ4 legacy and gzip are tried. Other formats, such as LZ4 frames which the
+// kernel cannot unpack as an initramfs, have to be listed explicitly.
+//
+// A candidate stops encoding as soon as it can no longer win, so the losing
+// trial encodes don't run to completion. Candidates use single-threaded
+// encoders, which write their output as they go instead of in whole batches
+// of blocks, so that a losing candidate is noticed early. The output buffers
+// of dropped candidates are reused by the ones that start after them.
+
+const DEFAULT_CANDIDATES: [FileFormat; 2] = [FileFormat::LZ4_LEGACY, FileFormat::GZIP];
+
+// Feed the encoders in chunks so that dropped candidates stop early
+const FEED_CHUNK: usize = 0x100000;
+
+// From the fastest to the slowest to decompress
+const SPEED_RANK: [FileFormat; 9] = [
+    FileFormat::LZ4_LEGACY,
+    FileFormat::LZ4_LG,
+    FileFormat::LZ4,
+    FileFormat::ZSTD,
+    FileFormat::GZIP,
+    FileFormat::ZOPFLI,
+    FileFormat::LZMA,
+    FileFormat::XZ,
+    FileFormat::BZIP2,
+];
+
+fn parse_budget(s: &str) -> Option<usize> {
+    let (num, shift) = match s.as_bytes().last() {
+        Some(b'k' | b'K') => (&s[..s.len() - 1], 10),
+        Some(b'm' | b'M') => (&s[..s.len() - 1], 20),
+        _ => (s, 0),
+    };
+    num.parse::<usize>()
+        .ok()
+        .filter(|n| *n > 0)
+        .map(|n| n << shift)
+}
+
+fn candidates(stock: FileFormat) -> Vec<FileFormat> {
+    let list = env::var("MAGISKBOOT_RAMDISK_FORMATS").unwrap_or_default();
+    let mut formats: Vec<FileFormat> = if list.is_empty() {
+        let mut formats = DEFAULT_CANDIDATES.to_vec();
+        formats.push(stock);
+        formats
+    } else {
+        list.split(',')
+            .filter_map(|s| match FileFormat::from_str(s.trim()) {
+                Ok(fmt) => Some(fmt),
+                Err(_) => {
+                    eprintln!("! Unknown ramdisk format: {s}");
+                    None
+                }
+            })
+            .collect()
+    };
+    formats.sort_by_key(|f| SPEED_RANK.iter().position(|r| r == f));
+    formats.dedup();
+    formats
+}
+
+// Shared state of all trial encodes
+struct Race {
+    budget: usize,
+    // Smallest finished output so far
+    best_size: AtomicUsize,
+    // Fastest finished candidate that fits in the budget
+    best_fit: AtomicUsize,
+    // Output buffers of dropped candidates
+    spare: Mutex<Vec<Vec<u8>>>,
+}
+
+impl Race {
+    // Whether the candidate at rank can still win with at least size bytes of output
+    fn can_win(&self, rank: usize, size: usize) -> bool {
+        rank <= self.best_fit.load(Ordering::Relaxed)
+            && size <= max(self.budget, self.best_size.load(Ordering::Relaxed))
+    }
+
+    fn take_buf(&self) -> Vec<u8> {
+        self.spare.lock().unwrap().pop().unwrap_or_default()
+    }
+
+    fn give_buf(&self, mut buf: Vec<u8>) {
+        if buf.capacity() != 0 {
+            buf.clear();
+            self.spare.lock().unwrap().push(buf);
+        }
+    }
+
+    fn finish(&self, rank: usize, size: usize) {
+        self.best_size.fetch_min(size, Ordering::Relaxed);
+        if self.budget != 0 && size <= self.budget {
+            self.best_fit.fetch_min(rank, Ordering::Relaxed);
+        }
+    }
+}
+
+// Collects the output of a candidate, and fails once the candidate can't win
+struct TrialWriter<'a> {
+    out: Vec<u8>,
+    race: &'a Race,
+    rank: usize,
+}
+
+impl Write for TrialWriter<'_> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        if !self.race.can_win(self.rank, self.out.len() + buf.len()) {
+            return Err(Error::other("candidate dropped"));
+        }
+        self.out.extend_from_slice(buf);
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        Ok(())
+    }
+}
+
+// The output of a dropped candidate goes back to the shared buffers
+impl Drop for TrialWriter<'_> {
+    fn drop(&mut self) {
+        self.race.give_buf(take(&mut self.out));
+    }
+}
+
+fn trial(format: FileFormat, rank: usize, in_bytes: &[u8], race: &Race) -> Option<Vec<u8>> {
+    let writer = TrialWriter {
+        out: race.take_buf(),
+        race,
+        rank,
+    };
+    let mut encoder = get_encoder(format, writer);
+    for chunk in in_bytes.chunks(FEED_CHUNK) {
+        encoder.write_all(chunk).ok()?;
+    }
+    let out = take(&mut encoder.finish().ok()?.out);
+    if !race.can_win(rank, out.len()) {
+        race.give_buf(out);
+        return None;
+    }
+    race.finish(rank, out.len());
+    Some(out)
+}
+
+pub fn ramdisk_auto_enabled() -> bool {
+    check_env("MAGISKBOOT_RAMDISK_AUTO")
+}
+
+// Compress the ramdisk with the best candidate format into out, and return the
+// chosen format. Falls back to the original format if every candidate fails,
+// and returns UNKNOWN if that fails too.
+pub fn compress_ramdisk_auto(
+    fallback: FileFormat,
+    in_bytes: &[u8],
+    out: &mut Vec<u8>,
+) -> FileFormat {
+    let formats = candidates(fallback);
+    let race = Race {
+        budget: env::var("MAGISKBOOT_RAMDISK_BUDGET")
+            .ok()
+            .and_then(|s| parse_budget(&s))
+            .unwrap_or(0),
+        best_size: AtomicUsize::new(usize::MAX),
+        best_fit: AtomicUsize::new(usize::MAX),
+        spare: Mutex::new(Vec::new()),
+    };
+
+    // Candidates are ordered by speed, so the index is the rank
+    let ranked: Vec<(usize, FileFormat)> = formats.into_iter().enumerate().collect();
+    let results = par_map_workers(thread_count(), &ranked, |(rank, fmt)| {
+        with_worker_threads(1, || trial(*fmt, *rank, in_bytes, &race))
+    });
+
+    for ((_, fmt), res) in ranked.iter().zip(&results) {
+        match res {
+            Some(v) => eprintln!("RAMDISK_AUTO: [{fmt}] {} bytes", v.len()),
+            None => eprintln!("RAMDISK_AUTO: [{fmt}] dropped"),
+        }
+    }
+
+    let finished = || {
+        ranked
+            .iter()
+            .zip(results.iter())
+            .filter_map(|((_, fmt), res)| res.as_ref().map(|v| (*fmt, v)))
+    };
+    // Ties are resolved towards the faster candidate, so the choice never
+    // depends on which encoder finished first
+    let fit = finished().find(|(_, v)| race.budget != 0 && v.len() <= race.budget);
+    let winner = fit.or_else(|| {
+        if race.budget != 0 {
+            eprintln!("! No ramdisk format fits in {} bytes", race.budget);
+        }
+        finished().min_by_key(|(_, v)| v.len())
+    });
+
+    match winner {
+        Some((fmt, v)) => {
+            out.extend_from_slice(v);
+            fmt
+        }
+        None => match compress_vec(fallback, in_bytes).log() {
+            Ok(v) => {
+                *out = v;
+                fallback
+            }
+            Err(_) => FileFormat::UNKNOWN,
+        },
+    }
+}
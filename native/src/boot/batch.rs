@@ -0,0 +1,134 @@
+use crate::parallel::{par_map_workers, thread_count};
+use base::{LoggedResult, Utf8CStr, log_err};
+use std::cmp::max;
+use std::fs;
+use std::io::{Read, stdin};
+use std::mem::take;
+use std::time::{Duration, Instant};
+
+struct BatchJob {
+    line_no: usize,
+    line: String,
+    args: Vec<String>,
+}
+
+struct BatchResult {
+    code: i32,
+    time: Duration,
+}
+
+// Split a manifest line into arguments. Arguments are separated by whitespace,
+// and can be quoted with ' or " to contain whitespace.
+fn split_args(line: &str) -> Option<Vec<String>> {
+    let mut args = Vec::new();
+    let mut arg = String::new();
+    let mut in_arg = false;
+    let mut quote = None;
+    for c in line.chars() {
+        match quote {
+            Some(q) if c == q => quote = None,
+            Some(_) => arg.push(c),
+            None if c == '\'' || c == '"' => {
+                quote = Some(c);
+                in_arg = true;
+            }
+            None if c.is_whitespace() => {
+                if in_arg {
+                    args.push(take(&mut arg));
+                    in_arg = false;
+                }
+            }
+            None => {
+                arg.push(c);
+                in_arg = true;
+            }
+        }
+    }
+    if quote.is_some() {
+        return None;
+    }
+    if in_arg {
+        args.push(arg);
+    }
+    Some(args)
+}
+
+fn parse_manifest(manifest: &str) -> LoggedResult<Vec<BatchJob>> {
+    let mut jobs = Vec::new();
+    for (i, line) in manifest.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+        let Some(args) = split_args(line) else {
+            return log_err!("Unterminated quote at line {}", i + 1);
+        };
+        jobs.push(BatchJob {
+            line_no: i + 1,
+            line: line.to_string(),
+            args,
+        });
+    }
+    Ok(jobs)
+}
+
+// Run every command of the manifest with a pool of `jobs` workers.
+// The threads of each worker are shared out evenly, so that the total
+// number of threads stays the same as for a single command.
+pub(crate) fn batch_cmd<F>(manifest: &Utf8CStr, jobs: Option<usize>, run: F) -> LoggedResult<i32>
+where
+    F: Fn(&[&str]) -> i32 + Sync,
+{
+    let manifest = if manifest == "-" {
+        let mut s = String::new();
+        stdin().read_to_string(&mut s)?;
+        s
+    } else {
+        fs::read_to_string(manifest.as_str())?
+    };
+    let batch = parse_manifest(&manifest)?;
+
+    let workers = jobs
+        .unwrap_or_else(thread_count)
+        .clamp(1, max(batch.len(), 1));
+
+    let start = Instant::now();
+    let results = par_map_workers(workers, &batch, |job| {
+        let args: Vec<&str> = job.args.iter().map(String::as_str).collect();
+        let start = Instant::now();
+        let code = run(&args);
+        BatchResult {
+            code,
+            time: start.elapsed(),
+        }
+    });
+    let total = start.elapsed();
+
+    // Report in manifest order once everything is done
+    let mut failed = 0;
+    println!("LINE  RESULT     TIME  COMMAND");
+    for (job, res) in batch.iter().zip(&results) {
+        if res.code != 0 {
+            failed += 1;
+        }
+        println!(
+            "{:<5} {:<6} {:>7.3}s  {}",
+            job.line_no,
+            if res.code == 0 {
+                "OK".to_string()
+            } else {
+                format!("ERR {}", res.code)
+            },
+            res.time.as_secs_f64(),
+            job.line
+        );
+    }
+    println!(
+        "{} commands, {} failed, {} workers, {:.3}s",
+        batch.len(),
+        failed,
+        workers,
+        total.as_secs_f64()
+    );
+    Ok(if failed == 0 { 0 } else { 1 })
+}
@@ -1,13 +1,17 @@
-#include <bit>
+#include <atomic>
 #include <functional>
+#include <map>
 #include <memory>
+#include <optional>
 #include <span>
+#include <thread>
 
 #include <base.hpp>
 
 #include "boot-rs.hpp"
 #include "bootimg.hpp"
 #include "magiskboot.hpp"
+#include "scan.hpp"
 
 using namespace std;
 
@@ -24,11 +28,29 @@ static void decompress(FileFormat type, int fd, const void *in, size_t size) {
     decompress_bytes(type, byte_view { in, size }, fd);
 }
 
-static off_t compress_len(FileFormat type, byte_view in, int fd) {
-    auto prev = lseek(fd, 0, SEEK_CUR);
-    compress_bytes(type, in, fd);
-    auto now = lseek(fd, 0, SEEK_CUR);
-    return now - prev;
+// Run task(i) for every i in [0, n) with up to thread_count() worker threads.
+// The threads are shared out between the workers, so that the Rust encoders
+// and decoders run by the tasks don't start thread_count() threads each.
+static void parallel_for(size_t n, const function<void(size_t)> &task) {
+    size_t workers = std::min(n, thread_count());
+    if (workers <= 1) {
+        for (size_t i = 0; i < n; ++i)
+            task(i);
+        return;
+    }
+    size_t share = std::max<size_t>(thread_count() / workers, 1);
+    atomic_size_t next = 0;
+    vector<thread> pool;
+    pool.reserve(workers);
+    for (size_t t = 0; t < workers; ++t) {
+        pool.emplace_back([&] {
+            set_worker_threads(share);
+            for (size_t i; (i = next++) < n;)
+                task(i);
+        });
+    }
+    for (auto &t : pool)
+        t.join();
 }
 
 static void dump(const void *buf, size_t size, const char *filename) {
@@ -39,15 +61,6 @@ static void dump(const void *buf, size_t size, const char *filename) {
     close(fd);
 }
 
-static size_t restore(int fd, const char *filename) {
-    int ifd = xopen(filename, O_RDONLY);
-    size_t size = lseek(ifd, 0, SEEK_END);
-    lseek(ifd, 0, SEEK_SET);
-    xsendfile(fd, ifd, nullptr, size);
-    close(ifd);
-    return size;
-}
-
 static bool check_env(const char *name) {
     const char *val = getenv(name);
     return val != nullptr && val == "true"sv;
@@ -75,6 +88,8 @@ FileFormat check_fmt(const void *buf, size_t len) {
         return FileFormat::LZ4;
     } else if (CHECKED_MATCH(LZ4_LEG_MAGIC)) {
         return FileFormat::LZ4_LEGACY;
+    } else if (CHECKED_MATCH(ZSTD_MAGIC)) {
+        return FileFormat::ZSTD;
     } else if (CHECKED_MATCH(MTK_MAGIC)) {
         return FileFormat::MTK;
     } else if (CHECKED_MATCH(DTB_MAGIC)) {
@@ -194,8 +209,14 @@ void dyn_img_hdr::load_hdr_file() {
 boot_img::boot_img(const char *image) :
 map(image), k_fmt(FileFormat::UNKNOWN), r_fmt(FileFormat::UNKNOWN), e_fmt(FileFormat::UNKNOWN) {
     fprintf(stderr, "Parsing boot image: [%s]\n", image);
-    for (const uint8_t *addr = map.data(); addr < map.data() + map.size(); ++addr) {
-        FileFormat fmt = check_fmt(addr, map.size());
+    // Only look at offsets that could be the start of any of these headers
+    const magic_scanner scanner = {
+        CHROMEOS_MAGIC, BOOT_MAGIC, VENDOR_BOOT_MAGIC, DHTB_MAGIC, TEGRABLOB_MAGIC
+    };
+    const uint8_t *end = map.data() + map.size();
+    for (const uint8_t *addr = scanner.find(map.data(), end); addr < end;
+         addr = scanner.find(addr + 1, end)) {
+        FileFormat fmt = check_fmt(addr, end - addr);
         switch (fmt) {
         case FileFormat::CHROMEOS:
             // chromeos require external signing
@@ -215,91 +236,22 @@ map(image), k_fmt(FileFormat::UNKNOWN), r_fmt(FileFormat::UNKNOWN), e_fmt(FileFo
             break;
         case FileFormat::AOSP:
         case FileFormat::AOSP_VENDOR:
-            if (parse_image(addr, fmt))
+            if (parse_image(addr, fmt)) {
+                valid = true;
                 return;
+            }
             // fallthrough
         default:
             break;
         }
     }
-    exit(RETURN_ERROR);
+    fprintf(stderr, "! No valid boot image found in [%s]\n", image);
 }
 
 boot_img::~boot_img() {
     delete hdr;
 }
 
-struct [[gnu::packed]] fdt_header {
-    struct fdt32_t {
-        uint32_t byte0: 8;
-        uint32_t byte1: 8;
-        uint32_t byte2: 8;
-        uint32_t byte3: 8;
-
-        constexpr operator uint32_t() const {
-            return bit_cast<uint32_t>(fdt32_t {
-                .byte0 = byte3,
-                .byte1 = byte2,
-                .byte2 = byte1,
-                .byte3 = byte0
-            });
-        }
-    };
-
-    struct node_header {
-        fdt32_t tag;
-        char name[0];
-    };
-
-    fdt32_t magic;			 /* magic word FDT_MAGIC */
-    fdt32_t totalsize;		 /* total size of DT block */
-    fdt32_t off_dt_struct;		 /* offset to structure */
-    fdt32_t off_dt_strings;		 /* offset to strings */
-    fdt32_t off_mem_rsvmap;		 /* offset to memory reserve map */
-    fdt32_t version;		 /* format version */
-    fdt32_t last_comp_version;	 /* last compatible version */
-
-    /* version 2 fields below */
-    fdt32_t boot_cpuid_phys;	 /* Which physical CPU id we're
-					    booting on */
-    /* version 3 fields below */
-    fdt32_t size_dt_strings;	 /* size of the strings block */
-
-    /* version 17 fields below */
-    fdt32_t size_dt_struct;		 /* size of the structure block */
-};
-
-static int find_dtb_offset(const uint8_t *buf, unsigned sz) {
-    const uint8_t * const end = buf + sz;
-
-    for (auto curr = buf; curr < end; curr += sizeof(fdt_header)) {
-        curr = static_cast<uint8_t*>(memmem(curr, end - curr, DTB_MAGIC, sizeof(fdt_header::fdt32_t)));
-        if (curr == nullptr)
-            return -1;
-
-        auto fdt_hdr = reinterpret_cast<const fdt_header *>(curr);
-
-        // Check that fdt_header.totalsize does not overflow kernel image size or is empty dtb
-		// https://github.com/torvalds/linux/commit/7b937cc243e5b1df8780a0aa743ce800df6c68d1
-        uint32_t totalsize = fdt_hdr->totalsize;
-        if (totalsize > end - curr || totalsize <= 0x48)
-            continue;
-
-        // Check that fdt_header.off_dt_struct does not overflow kernel image size
-        uint32_t off_dt_struct = fdt_hdr->off_dt_struct;
-        if (off_dt_struct > end - curr)
-            continue;
-
-        // Check that fdt_node_header.tag of first node is FDT_BEGIN_NODE
-        auto fdt_node_hdr = reinterpret_cast<const fdt_header::node_header *>(curr + off_dt_struct);
-        if (fdt_node_hdr->tag != 0x1u)
-            continue;
-
-        return curr - buf;
-    }
-    return -1;
-}
-
 static FileFormat check_fmt_lg(const uint8_t *buf, unsigned sz) {
     FileFormat fmt = check_fmt(buf, sz);
     if (fmt == FileFormat::LZ4_LEGACY) {
@@ -451,19 +403,20 @@ static const char *vendor_ramdisk_type(int type) {
     }
 }
 
+// Name of the file a vendor ramdisk is unpacked to, inside VND_RAMDISK_DIR
+static string vendor_ramdisk_file(const vendor_ramdisk_table_entry_v4 &it) {
+    if (it.ramdisk_name[0] == '\0')
+        return RAMDISK_FILE;
+    return string(it.ramdisk_name, strnlen(it.ramdisk_name, sizeof(it.ramdisk_name))) + ".cpio";
+}
+
 std::span<const vendor_ramdisk_table_entry_v4> boot_img::vendor_ramdisk_tbl() const {
     if (hdr->vendor_ramdisk_table_size() == 0) {
         return {};
     }
 
-    // v4 vendor boot contains multiple ramdisks
+    // v4 vendor boot contains multiple ramdisks, the entry size is checked in parse_image
     using table_entry = const vendor_ramdisk_table_entry_v4;
-    if (hdr->vendor_ramdisk_table_entry_size() != sizeof(table_entry)) {
-        fprintf(stderr,
-                "! Invalid vendor image: vendor_ramdisk_table_entry_size != %zu\n",
-                sizeof(table_entry));
-        exit(RETURN_ERROR);
-    }
     return span(reinterpret_cast<table_entry *>(vendor_ramdisk_table), hdr->vendor_ramdisk_table_entry_num());
 }
 
@@ -515,7 +468,8 @@ bool boot_img::parse_image(const uint8_t *addr, FileFormat type) {
     tail = byte_view(tail_addr, map.data() + map_end - tail_addr);
 
     if (auto size = hdr->kernel_size()) {
-        if (int dtb_off = find_dtb_offset(kernel, size); dtb_off > 0) {
+        if (auto dtbs = find_dtbs(kernel, size); !dtbs.empty() && dtbs[0] > 0) {
+            size_t dtb_off = dtbs[0];
             kernel_dtb = byte_view(kernel + dtb_off, size - dtb_off);
             hdr->kernel_size() = dtb_off;
             fprintf(stderr, "%-*s [%zu]\n", PADDING, "KERNEL_DTB_SZ", kernel_dtb.size());
@@ -539,6 +493,12 @@ bool boot_img::parse_image(const uint8_t *addr, FileFormat type) {
     }
     if (auto size = hdr->ramdisk_size()) {
         if (hdr->vendor_ramdisk_table_size()) {
+            if (hdr->vendor_ramdisk_table_entry_size() != sizeof(vendor_ramdisk_table_entry_v4)) {
+                fprintf(stderr,
+                        "! Invalid vendor image: vendor_ramdisk_table_entry_size != %zu\n",
+                        sizeof(vendor_ramdisk_table_entry_v4));
+                return false;
+            }
             for (auto &it : vendor_ramdisk_tbl()) {
                 FileFormat fmt = check_fmt_lg(ramdisk + it.ramdisk_offset, it.ramdisk_size);
                 fprintf(stderr,
@@ -599,7 +559,8 @@ bool boot_img::parse_image(const uint8_t *addr, FileFormat type) {
 int split_image_dtb(Utf8CStr filename, bool skip_decomp) {
     mmap_data img(filename.c_str());
 
-    if (size_t off = find_dtb_offset(img.data(), img.size()); off > 0) {
+    if (auto dtbs = find_dtbs(img.data(), img.size()); !dtbs.empty() && dtbs[0] > 0) {
+        size_t off = dtbs[0];
         FileFormat fmt = check_fmt_lg(img.data(), img.size());
         if (!skip_decomp && fmt_compressed(fmt)) {
             int fd = creat(KERNEL_FILE, 0644);
@@ -616,18 +577,33 @@ int split_image_dtb(Utf8CStr filename, bool skip_decomp) {
     }
 }
 
+// A section that is decompressed into its own file during unpack
+struct unpack_job {
+    FileFormat fmt;
+    byte_view in;
+    int fd;
+    rust::String err;
+};
+
 int unpack(Utf8CStr image, bool skip_decomp, bool hdr) {
     const boot_img boot(image.c_str());
+    if (!boot.valid)
+        return RETURN_ERROR;
 
     if (hdr)
         boot.hdr->dump_hdr_file();
 
+    // All sections are independent, so collect the decompression jobs first
+    // and run them concurrently once all output files are created.
+    vector<unpack_job> jobs;
+    auto add_job = [&](FileFormat fmt, const void *in, size_t size, int fd) {
+        jobs.push_back({ fmt, byte_view { in, size }, fd, {} });
+    };
+
     // Dump kernel
     if (!skip_decomp && fmt_compressed(boot.k_fmt)) {
         if (boot.hdr->kernel_size() != 0) {
-            int fd = creat(KERNEL_FILE, 0644);
-            decompress(boot.k_fmt, fd, boot.kernel, boot.hdr->kernel_size());
-            close(fd);
+            add_job(boot.k_fmt, boot.kernel, boot.hdr->kernel_size(), creat(KERNEL_FILE, 0644));
         }
     } else {
         dump(boot.kernel, boot.hdr->kernel_size(), KERNEL_FILE);
@@ -641,25 +617,19 @@ int unpack(Utf8CStr image, bool skip_decomp, bool hdr) {
         xmkdir(VND_RAMDISK_DIR, 0755);
         owned_fd dirfd = xopen(VND_RAMDISK_DIR, O_RDONLY | O_CLOEXEC);
         for (auto &it : boot.vendor_ramdisk_tbl()) {
-            char file_name[40];
-            if (it.ramdisk_name[0] == '\0') {
-                strscpy(file_name, RAMDISK_FILE, sizeof(file_name));
-            } else {
-                ssprintf(file_name, sizeof(file_name), "%s.cpio", it.ramdisk_name);
-            }
-            owned_fd fd = xopenat(dirfd, file_name, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+            int fd = xopenat(dirfd, vendor_ramdisk_file(it).c_str(),
+                             O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
             FileFormat fmt = check_fmt_lg(boot.ramdisk + it.ramdisk_offset, it.ramdisk_size);
             if (!skip_decomp && fmt_compressed(fmt)) {
-                decompress(fmt, fd, boot.ramdisk + it.ramdisk_offset, it.ramdisk_size);
+                add_job(fmt, boot.ramdisk + it.ramdisk_offset, it.ramdisk_size, fd);
             } else {
                 xwrite(fd, boot.ramdisk + it.ramdisk_offset, it.ramdisk_size);
+                close(fd);
             }
         }
     } else if (!skip_decomp && fmt_compressed(boot.r_fmt)) {
         if (boot.hdr->ramdisk_size() != 0) {
-            int fd = creat(RAMDISK_FILE, 0644);
-            decompress(boot.r_fmt, fd, boot.ramdisk, boot.hdr->ramdisk_size());
-            close(fd);
+            add_job(boot.r_fmt, boot.ramdisk, boot.hdr->ramdisk_size(), creat(RAMDISK_FILE, 0644));
         }
     } else {
         dump(boot.ramdisk, boot.hdr->ramdisk_size(), RAMDISK_FILE);
@@ -671,9 +641,7 @@ int unpack(Utf8CStr image, bool skip_decomp, bool hdr) {
     // Dump extra
     if (!skip_decomp && fmt_compressed(boot.e_fmt)) {
         if (boot.hdr->extra_size() != 0) {
-            int fd = creat(EXTRA_FILE, 0644);
-            decompress(boot.e_fmt, fd, boot.extra, boot.hdr->extra_size());
-            close(fd);
+            add_job(boot.e_fmt, boot.extra, boot.hdr->extra_size(), creat(EXTRA_FILE, 0644));
         }
     } else {
         dump(boot.extra, boot.hdr->extra_size(), EXTRA_FILE);
@@ -688,6 +656,17 @@ int unpack(Utf8CStr image, bool skip_decomp, bool hdr) {
     // Dump bootconfig
     dump(boot.bootconfig, boot.hdr->bootconfig_size(), BOOTCONFIG_FILE);
 
+    parallel_for(jobs.size(), [&](size_t i) {
+        auto &job = jobs[i];
+        job.err = decompress_bytes_quiet(job.fmt, job.in, job.fd);
+    });
+    // Report errors in the same order as the sections are dumped
+    for (auto &job : jobs) {
+        if (!job.err.empty())
+            fprintf(stderr, "%s\n", job.err.c_str());
+        close(job.fd);
+    }
+
     if (boot.flags[CHROMEOS_FLAG]) return RETURN_CHROMEOS;
     if (boot.hdr->is_vendor()) return RETURN_VENDOR;
     return RETURN_OK;
@@ -698,8 +677,111 @@ write_zero(fd, align_padding(lseek(fd, 0, SEEK_CUR) - off.header, page_size))
 
 #define file_align() file_align_with(boot.hdr->page_size())
 
-void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
-    const boot_img boot(src_img.c_str());
+// Where repack gets the components of the new image from
+struct repack_input {
+    virtual ~repack_input() = default;
+    virtual bool exists(const char *name) const = 0;
+    // The returned data stays valid as long as the input
+    virtual byte_view load(const char *name) = 0;
+};
+
+// The component files created by unpack in the current directory
+struct file_input : public repack_input {
+    bool exists(const char *name) const override {
+        return access(name, R_OK) == 0;
+    }
+    byte_view load(const char *name) override {
+        return maps.emplace_back(name);
+    }
+
+    vector<mmap_data> maps;
+};
+
+// Components held in memory, anything missing is treated as a missing file
+struct memory_input : public repack_input {
+    bool exists(const char *name) const override {
+        return files.contains(name);
+    }
+    byte_view load(const char *name) override {
+        auto it = files.find(name);
+        return it == files.end() ? byte_view() : it->second;
+    }
+
+    map<string, byte_view> files;
+};
+
+// A component that may have to be compressed while repacking
+struct repack_block {
+    byte_view data;
+    bool exists = false;
+    // UNKNOWN means the data is copied as is
+    FileFormat fmt = FileFormat::UNKNOWN;
+    // Compressed data
+    rust::Vec<uint8_t> out;
+    bool failed = false;
+    // Pick the format automatically, fmt is only used as a fallback
+    bool auto_fmt = false;
+
+    void load(byte_view d, FileFormat f, bool skip_comp) {
+        data = d;
+        exists = true;
+        if (!skip_comp && !fmt_compressed_any(check_fmt(data.data(), data.size())) && fmt_compressed(f))
+            fmt = f;
+    }
+
+    bool need_compress() const { return fmt != FileFormat::UNKNOWN; }
+
+    void compress() {
+        if (auto_fmt) {
+            FileFormat f = compress_ramdisk_auto(fmt, data, out);
+            if (f == FileFormat::UNKNOWN) {
+                failed = true;
+                return;
+            }
+            fprintf(stderr, "RAMDISK_FMT: [%s] -> [%s]\n", fmt2name(fmt), fmt2name(f));
+            fmt = f;
+        } else {
+            failed = !compress_to_vec(fmt, data, out);
+        }
+    }
+
+    // The bytes to be written into the image
+    byte_view get() const {
+        if (!need_compress())
+            return data;
+        return byte_view(out.data(), out.size());
+    }
+};
+
+// The pieces of an image section. All pieces are written and fed to the
+// boot id hash in a single pass, so the output never has to be read back.
+struct section_writer {
+    vector<byte_view> pieces;
+
+    void add(byte_view v) {
+        if (v.size())
+            pieces.push_back(v);
+    }
+
+    size_t size() const {
+        size_t sz = 0;
+        for (auto &v : pieces)
+            sz += v.size();
+        return sz;
+    }
+
+    size_t write(int fd, SHA *ctx) const {
+        size_t sz = 0;
+        for (auto &v : pieces) {
+            sz += xwrite(fd, v.data(), v.size());
+            if (ctx)
+                ctx->update(v);
+        }
+        return sz;
+    }
+};
+
+static bool repack(const boot_img &boot, repack_input &in, Utf8CStr out_img, bool skip_comp) {
     fprintf(stderr, "Repack to boot image: [%s]\n", out_img.c_str());
 
     struct {
@@ -718,12 +800,76 @@ void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
     hdr->kernel_size() = 0;
     hdr->ramdisk_size() = 0;
     hdr->second_size() = 0;
+    hdr->extra_size() = 0;
+    hdr->recovery_dtbo_size() = 0;
     hdr->dtb_size() = 0;
     hdr->bootconfig_size() = 0;
 
-    if (access(HEADER_FILE, R_OK) == 0)
+    if (in.exists(HEADER_FILE))
         hdr->load_hdr_file();
 
+    /*******************
+     * Load components
+     *******************/
+
+    repack_block kernel_blk, ramdisk_blk, extra_blk;
+    vector<repack_block> vnd_ramdisk_blks;
+    vector<vendor_ramdisk_table_entry_v4> ramdisk_table;
+
+    if (in.exists(KERNEL_FILE)) {
+        // Always use zopfli for zImage compression
+        auto fmt = (boot.flags[ZIMAGE_KERNEL] && boot.k_fmt == FileFormat::GZIP) ? FileFormat::ZOPFLI : boot.k_fmt;
+        kernel_blk.load(in.load(KERNEL_FILE), fmt, skip_comp);
+    }
+
+    if (boot.hdr->vendor_ramdisk_table_size()) {
+        // Create a copy so we can modify it
+        ramdisk_table.assign_range(boot.vendor_ramdisk_tbl());
+        vnd_ramdisk_blks.resize(ramdisk_table.size());
+
+        for (size_t i = 0; i < ramdisk_table.size(); ++i) {
+            auto &it = ramdisk_table[i];
+            FileFormat fmt = check_fmt_lg(boot.ramdisk + it.ramdisk_offset, it.ramdisk_size);
+            auto file = VND_RAMDISK_DIR "/" + vendor_ramdisk_file(it);
+            vnd_ramdisk_blks[i].load(in.load(file.c_str()), fmt, skip_comp);
+        }
+    } else if (in.exists(RAMDISK_FILE)) {
+        auto r_fmt = boot.r_fmt;
+        if (!skip_comp && !hdr->is_vendor() && hdr->header_version() == 4 && r_fmt != FileFormat::LZ4_LEGACY) {
+            // A v4 boot image ramdisk will have to be merged with other vendor ramdisks,
+            // and they have to use the exact same compression method. v4 GKIs are required to
+            // use lz4 (legacy), so hardcode the format here.
+            fprintf(stderr, "RAMDISK_FMT: [%s] -> [%s]\n", fmt2name(r_fmt), fmt2name(FileFormat::LZ4_LEGACY));
+            r_fmt = FileFormat::LZ4_LEGACY;
+        }
+        ramdisk_blk.load(in.load(RAMDISK_FILE), r_fmt, skip_comp);
+        // v4 boot image ramdisks are restricted to lz4 (legacy), see above
+        if (ramdisk_blk.need_compress() && (hdr->is_vendor() || hdr->header_version() != 4))
+            ramdisk_blk.auto_fmt = ramdisk_auto_enabled();
+    }
+
+    if (in.exists(EXTRA_FILE)) {
+        extra_blk.load(in.load(EXTRA_FILE), boot.e_fmt, skip_comp);
+    }
+
+    // Compress all components before writing anything, on worker threads if possible
+    vector<repack_block *> jobs;
+    for (auto blk : { &kernel_blk, &ramdisk_blk, &extra_blk }) {
+        if (blk->need_compress())
+            jobs.push_back(blk);
+    }
+    for (auto &blk : vnd_ramdisk_blks) {
+        if (blk.need_compress())
+            jobs.push_back(&blk);
+    }
+    parallel_for(jobs.size(), [&](size_t i) { jobs[i]->compress(); });
+    for (auto blk : jobs) {
+        if (blk->failed) {
+            fprintf(stderr, "! Failed to compress [%s]\n", fmt2name(blk->fmt));
+            return false;
+        }
+    }
+
     /***************
      * Write blocks
      ***************/
@@ -731,6 +877,22 @@ void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
     // Create new image
     int fd = open(out_img.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
 
+    // The boot id is the hash of all sections, each followed by its size
+    optional<rust::Box<SHA>> id_ctx;
+    if (hdr->id())
+        id_ctx.emplace(get_sha(!boot.flags[SHA256_FLAG]));
+    auto hash_size = [&](uint32_t size) {
+        if (id_ctx)
+            (*id_ctx)->update(byte_view(&size, sizeof(size)));
+    };
+    auto write_section = [&](const section_writer &sec, bool hash) -> uint32_t {
+        uint32_t size = sec.write(fd, hash && id_ctx ? &**id_ctx : nullptr);
+        if (hash)
+            hash_size(size);
+        return size;
+    };
+    uint32_t ver = hdr->header_version();
+
     // Copy non-standard headers
     if (boot.flags[DHTB_FLAG]) {
         xwrite(fd, boot.map.data(), sizeof(dhtb_hdr));
@@ -748,139 +910,130 @@ void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
 
     // kernel
     off.kernel = lseek(fd, 0, SEEK_CUR);
-    if (boot.flags[MTK_KERNEL]) {
-        // Copy MTK headers
-        xwrite(fd, boot.k_hdr, sizeof(mtk_hdr));
-    }
-    if (boot.flags[ZIMAGE_KERNEL]) {
-        // Copy zImage headers
-        xwrite(fd, boot.z_info.hdr, boot.z_info.hdr_sz);
-    }
-    if (access(KERNEL_FILE, R_OK) == 0) {
-        mmap_data m(KERNEL_FILE);
-        if (!skip_comp && !fmt_compressed_any(check_fmt(m.data(), m.size())) && fmt_compressed(boot.k_fmt)) {
-            // Always use zopfli for zImage compression
-            auto fmt = (boot.flags[ZIMAGE_KERNEL] && boot.k_fmt == FileFormat::GZIP) ? FileFormat::ZOPFLI : boot.k_fmt;
-            hdr->kernel_size() = compress_len(fmt, m, fd);
-        } else {
-            hdr->kernel_size() = xwrite(fd, m.data(), m.size());
+    {
+        section_writer sec;
+        mtk_hdr m_hdr;
+        if (boot.flags[MTK_KERNEL]) {
+            // Copy MTK headers, the size is updated before writing
+            m_hdr = *boot.k_hdr;
+            sec.add(byte_view(&m_hdr, sizeof(m_hdr)));
         }
-
         if (boot.flags[ZIMAGE_KERNEL]) {
-            if (hdr->kernel_size() > boot.hdr->kernel_size()) {
-                fprintf(stderr, "! Recompressed kernel is too large, using original kernel\n");
-                ftruncate64(fd, lseek64(fd, - (off64_t) hdr->kernel_size(), SEEK_CUR));
-                xwrite(fd, boot.kernel, boot.hdr->kernel_size());
-            } else if (!skip_comp) {
-                // Pad zeros to make sure the zImage file size does not change
-                // Also ensure the last 4 bytes are the uncompressed vmlinux size
-                uint32_t sz = m.size();
-                write_zero(fd, boot.hdr->kernel_size() - hdr->kernel_size() - sizeof(sz));
-                xwrite(fd, &sz, sizeof(sz));
+            // Copy zImage headers
+            sec.add(byte_view(boot.z_info.hdr, boot.z_info.hdr_sz));
+        }
+        heap_data zimage_pad;
+        uint32_t vmlinux_sz = kernel_blk.data.size();
+        if (kernel_blk.exists) {
+            byte_view kernel = kernel_blk.get();
+            if (boot.flags[ZIMAGE_KERNEL]) {
+                size_t orig_sz = boot.hdr->kernel_size();
+                if (kernel.size() > orig_sz) {
+                    fprintf(stderr, "! Recompressed kernel is too large, using original kernel\n");
+                    sec.add(byte_view(boot.kernel, orig_sz));
+                } else {
+                    // Pad zeros to make sure the zImage file size does not change
+                    // Also ensure the last 4 bytes are the uncompressed vmlinux size
+                    sec.add(kernel);
+                    bool add_sz = !skip_comp && orig_sz - kernel.size() >= sizeof(vmlinux_sz);
+                    zimage_pad = heap_data(orig_sz - kernel.size() - (add_sz ? sizeof(vmlinux_sz) : 0));
+                    sec.add(zimage_pad);
+                    if (add_sz)
+                        sec.add(byte_view(&vmlinux_sz, sizeof(vmlinux_sz)));
+                }
+            } else {
+                sec.add(kernel);
             }
-
-            // zImage size shall remain the same
-            hdr->kernel_size() = boot.hdr->kernel_size();
+        } else if (boot.hdr->kernel_size() != 0) {
+            sec.add(byte_view(boot.kernel, boot.hdr->kernel_size()));
         }
-    } else if (boot.hdr->kernel_size() != 0) {
-        xwrite(fd, boot.kernel, boot.hdr->kernel_size());
-        hdr->kernel_size() = boot.hdr->kernel_size();
-    }
-    if (boot.flags[ZIMAGE_KERNEL]) {
-        // Copy zImage tail and adjust size accordingly
-        hdr->kernel_size() += boot.z_info.hdr_sz;
-        hdr->kernel_size() += xwrite(fd, boot.z_info.tail.data(), boot.z_info.tail.size());
-    }
+        if (boot.flags[ZIMAGE_KERNEL]) {
+            // Copy zImage tail
+            sec.add(boot.z_info.tail);
+        }
+
+        // kernel dtb
+        if (in.exists(KER_DTB_FILE))
+            sec.add(in.load(KER_DTB_FILE));
 
-    // kernel dtb
-    if (access(KER_DTB_FILE, R_OK) == 0)
-        hdr->kernel_size() += restore(fd, KER_DTB_FILE);
+        if (boot.flags[MTK_KERNEL])
+            m_hdr.size = sec.size() - sizeof(m_hdr);
+        hdr->kernel_size() = write_section(sec, true);
+    }
     file_align();
 
     // ramdisk
     off.ramdisk = lseek(fd, 0, SEEK_CUR);
-    if (boot.flags[MTK_RAMDISK]) {
-        // Copy MTK headers
-        xwrite(fd, boot.r_hdr, sizeof(mtk_hdr));
-    }
-
-    vector<vendor_ramdisk_table_entry_v4> ramdisk_table;
-
-    if (boot.hdr->vendor_ramdisk_table_size()) {
-        // Create a copy so we can modify it
-        ramdisk_table.assign_range(boot.vendor_ramdisk_tbl());
+    {
+        section_writer sec;
+        mtk_hdr m_hdr;
+        if (boot.flags[MTK_RAMDISK]) {
+            // Copy MTK headers, the size is updated before writing
+            m_hdr = *boot.r_hdr;
+            sec.add(byte_view(&m_hdr, sizeof(m_hdr)));
+        }
 
-        owned_fd dirfd = xopen(VND_RAMDISK_DIR, O_RDONLY | O_CLOEXEC);
-        uint32_t ramdisk_offset = 0;
-        for (auto &it : ramdisk_table) {
-            char file_name[64];
-            if (it.ramdisk_name[0] == '\0') {
-                strscpy(file_name, RAMDISK_FILE, sizeof(file_name));
-            } else {
-                ssprintf(file_name, sizeof(file_name), "%s.cpio", it.ramdisk_name);
+        if (boot.hdr->vendor_ramdisk_table_size()) {
+            uint32_t ramdisk_offset = 0;
+            for (size_t i = 0; i < ramdisk_table.size(); ++i) {
+                auto &it = ramdisk_table[i];
+                byte_view ramdisk = vnd_ramdisk_blks[i].get();
+                it.ramdisk_offset = ramdisk_offset;
+                it.ramdisk_size = ramdisk.size();
+                ramdisk_offset += it.ramdisk_size;
+                sec.add(ramdisk);
             }
-            mmap_data m(dirfd, file_name);
-            FileFormat fmt = check_fmt_lg(boot.ramdisk + it.ramdisk_offset, it.ramdisk_size);
-            it.ramdisk_offset = ramdisk_offset;
-            if (!skip_comp && !fmt_compressed_any(check_fmt(m.data(), m.size())) && fmt_compressed(fmt)) {
-                it.ramdisk_size = compress_len(fmt, m, fd);
-            } else {
-                it.ramdisk_size = xwrite(fd, m.data(), m.size());
-            }
-            ramdisk_offset += it.ramdisk_size;
+        } else if (ramdisk_blk.exists) {
+            sec.add(ramdisk_blk.get());
         }
 
-        hdr->ramdisk_size() = ramdisk_offset;
-        file_align();
-    } else if (access(RAMDISK_FILE, R_OK) == 0) {
-        mmap_data m(RAMDISK_FILE);
-        auto r_fmt = boot.r_fmt;
-        if (!skip_comp && !hdr->is_vendor() && hdr->header_version() == 4 && r_fmt != FileFormat::LZ4_LEGACY) {
-            // A v4 boot image ramdisk will have to be merged with other vendor ramdisks,
-            // and they have to use the exact same compression method. v4 GKIs are required to
-            // use lz4 (legacy), so hardcode the format here.
-            fprintf(stderr, "RAMDISK_FMT: [%s] -> [%s]\n", fmt2name(r_fmt), fmt2name(FileFormat::LZ4_LEGACY));
-            r_fmt = FileFormat::LZ4_LEGACY;
-        }
-        if (!skip_comp && !fmt_compressed_any(check_fmt(m.data(), m.size())) && fmt_compressed(r_fmt)) {
-            hdr->ramdisk_size() = compress_len(r_fmt, m, fd);
-        } else {
-            hdr->ramdisk_size() = xwrite(fd, m.data(), m.size());
-        }
-        file_align();
+        if (boot.flags[MTK_RAMDISK])
+            m_hdr.size = sec.size() - sizeof(m_hdr);
+        hdr->ramdisk_size() = write_section(sec, true);
+        if (boot.hdr->vendor_ramdisk_table_size() || ramdisk_blk.exists)
+            file_align();
     }
 
     // second
     off.second = lseek(fd, 0, SEEK_CUR);
-    if (access(SECOND_FILE, R_OK) == 0) {
-        hdr->second_size() = restore(fd, SECOND_FILE);
-        file_align();
+    {
+        section_writer sec;
+        if (in.exists(SECOND_FILE))
+            sec.add(in.load(SECOND_FILE));
+        hdr->second_size() = write_section(sec, true);
+        if (sec.size())
+            file_align();
     }
 
     // extra
     off.extra = lseek(fd, 0, SEEK_CUR);
-    if (access(EXTRA_FILE, R_OK) == 0) {
-        mmap_data m(EXTRA_FILE);
-        if (!skip_comp && !fmt_compressed_any(check_fmt(m.data(), m.size())) && fmt_compressed(boot.e_fmt)) {
-            hdr->extra_size() = compress_len(boot.e_fmt, m, fd);
-        } else {
-            hdr->extra_size() = xwrite(fd, m.data(), m.size());
-        }
+    if (extra_blk.exists) {
+        section_writer sec;
+        sec.add(extra_blk.get());
+        hdr->extra_size() = write_section(sec, sec.size() != 0);
         file_align();
     }
 
     // recovery_dtbo
-    if (access(RECV_DTBO_FILE, R_OK) == 0) {
+    if (in.exists(RECV_DTBO_FILE)) {
+        section_writer sec;
+        sec.add(in.load(RECV_DTBO_FILE));
         hdr->recovery_dtbo_offset() = lseek(fd, 0, SEEK_CUR);
-        hdr->recovery_dtbo_size() = restore(fd, RECV_DTBO_FILE);
+        hdr->recovery_dtbo_size() = write_section(sec, ver == 1 || ver == 2);
         file_align();
+    } else if (ver == 1 || ver == 2) {
+        hash_size(0);
     }
 
     // dtb
     off.dtb = lseek(fd, 0, SEEK_CUR);
-    if (access(DTB_FILE, R_OK) == 0) {
-        hdr->dtb_size() = restore(fd, DTB_FILE);
-        file_align();
+    {
+        section_writer sec;
+        if (in.exists(DTB_FILE))
+            sec.add(in.load(DTB_FILE));
+        hdr->dtb_size() = write_section(sec, ver == 2);
+        if (sec.size())
+            file_align();
     }
 
     // Copy boot signature
@@ -896,8 +1049,9 @@ void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
     }
 
     // bootconfig
-    if (access(BOOTCONFIG_FILE, R_OK) == 0) {
-        hdr->bootconfig_size() = restore(fd, BOOTCONFIG_FILE);
+    if (in.exists(BOOTCONFIG_FILE)) {
+        byte_view bootconfig = in.load(BOOTCONFIG_FILE);
+        hdr->bootconfig_size() = xwrite(fd, bootconfig.data(), bootconfig.size());
         file_align();
     }
 
@@ -942,49 +1096,12 @@ void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
     // Map output image as rw
     mmap_data out(fd, lseek(fd, 0, SEEK_END), true);
 
-    // MTK headers
-    if (boot.flags[MTK_KERNEL]) {
-        auto m_hdr = reinterpret_cast<mtk_hdr *>(out.data() + off.kernel);
-        m_hdr->size = hdr->kernel_size();
-        hdr->kernel_size() += sizeof(mtk_hdr);
-    }
-    if (boot.flags[MTK_RAMDISK]) {
-        auto m_hdr = reinterpret_cast<mtk_hdr *>(out.data() + off.ramdisk);
-        m_hdr->size = hdr->ramdisk_size();
-        hdr->ramdisk_size() += sizeof(mtk_hdr);
-    }
-
     // Make sure header size matches
     hdr->header_size() = hdr->hdr_size();
 
     // Update checksum
     if (char *id = hdr->id()) {
-        auto ctx = get_sha(!boot.flags[SHA256_FLAG]);
-        uint32_t size = hdr->kernel_size();
-        ctx->update(byte_view(out.data() + off.kernel, size));
-        ctx->update(byte_view(&size, sizeof(size)));
-        size = hdr->ramdisk_size();
-        ctx->update(byte_view(out.data() + off.ramdisk, size));
-        ctx->update(byte_view(&size, sizeof(size)));
-        size = hdr->second_size();
-        ctx->update(byte_view(out.data() + off.second, size));
-        ctx->update(byte_view(&size, sizeof(size)));
-        size = hdr->extra_size();
-        if (size) {
-            ctx->update(byte_view(out.data() + off.extra, size));
-            ctx->update(byte_view(&size, sizeof(size)));
-        }
-        uint32_t ver = hdr->header_version();
-        if (ver == 1 || ver == 2) {
-            size = hdr->recovery_dtbo_size();
-            ctx->update(byte_view(out.data() + hdr->recovery_dtbo_offset(), size));
-            ctx->update(byte_view(&size, sizeof(size)));
-        }
-        if (ver == 2) {
-            size = hdr->dtb_size();
-            ctx->update(byte_view(out.data() + off.dtb, size));
-            ctx->update(byte_view(&size, sizeof(size)));
-        }
+        auto &ctx = *id_ctx;
         memset(id, 0, BOOT_ID_SIZE);
         ctx->finalize_into(byte_data(id, ctx->output_size()));
     }
@@ -1035,6 +1152,69 @@ void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
     }
 
     close(fd);
+    return true;
+}
+
+bool repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
+    const boot_img boot(src_img.c_str());
+    if (!boot.valid)
+        return false;
+    file_input in;
+    return repack(boot, in, out_img, skip_comp);
+}
+
+int patch_image(Utf8CStr src_img, Utf8CStr out_img, const rust::Vec<rust::String> &cmds) {
+    const boot_img boot(src_img.c_str());
+    if (!boot.valid)
+        return 1;
+
+    // Start with the sections of the original image, the same files 'unpack -n'
+    // would create. The kernel is left out, so the original one is copied as is.
+    memory_input in;
+    auto add = [&](const string &name, const void *buf, size_t size) {
+        if (size)
+            in.files.emplace(name, byte_view(buf, size));
+    };
+    add(KER_DTB_FILE, boot.kernel_dtb.data(), boot.kernel_dtb.size());
+    add(SECOND_FILE, boot.second, boot.hdr->second_size());
+    add(EXTRA_FILE, boot.extra, boot.hdr->extra_size());
+    add(RECV_DTBO_FILE, boot.recovery_dtbo, boot.hdr->recovery_dtbo_size());
+    add(DTB_FILE, boot.dtb, boot.hdr->dtb_size());
+    add(BOOTCONFIG_FILE, boot.bootconfig, boot.hdr->bootconfig_size());
+
+    // Pick the ramdisk to patch: the only one, or the default vendor ramdisk
+    string rd_file;
+    byte_view rd;
+    FileFormat rd_fmt = FileFormat::UNKNOWN;
+    if (boot.hdr->vendor_ramdisk_table_size()) {
+        for (auto &it : boot.vendor_ramdisk_tbl()) {
+            auto file = VND_RAMDISK_DIR "/" + vendor_ramdisk_file(it);
+            const uint8_t *buf = boot.ramdisk + it.ramdisk_offset;
+            if (it.ramdisk_name[0] == '\0') {
+                rd_file = file;
+                rd = byte_view(buf, it.ramdisk_size);
+                rd_fmt = check_fmt_lg(buf, it.ramdisk_size);
+            } else {
+                // Vendor ramdisk files are always created by unpack
+                in.files.emplace(file, byte_view(buf, it.ramdisk_size));
+            }
+        }
+        if (rd_file.empty()) {
+            fprintf(stderr, "! No default vendor ramdisk to patch\n");
+            return 1;
+        }
+    } else {
+        rd_file = RAMDISK_FILE;
+        rd = byte_view(boot.ramdisk, boot.hdr->ramdisk_size());
+        rd_fmt = boot.r_fmt;
+    }
+
+    rust::Vec<uint8_t> ramdisk;
+    if (!patch_ramdisk(rd_fmt, rd, cmds, ramdisk))
+        return 1;
+    in.files.emplace(rd_file, byte_view(ramdisk.data(), ramdisk.size()));
+
+    return repack(boot, in, out_img, false) ? 0 : 1;
 }
 
 void cleanup() {
@@ -677,6 +677,9 @@ struct boot_img {
     // dtb embedded in kernel
     byte_view kernel_dtb;
 
+    // Whether a header was found and parsed successfully
+    bool valid = false;
+
     explicit boot_img(const char *);
     ~boot_img();
 
@@ -686,7 +689,10 @@ struct boot_img {
     std::span<const vendor_ramdisk_table_entry_v4> vendor_ramdisk_tbl() const;
 
     // Rust FFI
-    static std::unique_ptr<boot_img> create(Utf8CStr name) { return std::make_unique<boot_img>(name.c_str()); }
+    static std::unique_ptr<boot_img> create(Utf8CStr name) {
+        auto img = std::make_unique<boot_img>(name.c_str());
+        return img->valid ? std::move(img) : nullptr;
+    }
     rust::Slice<const uint8_t> get_payload() const { return payload; }
     rust::Slice<const uint8_t> get_tail() const { return tail; }
     bool is_signed() const { return flags[AVB1_SIGNED_FLAG]; }
@@ -0,0 +1,141 @@
+use crate::sign::sha256_hash;
+use std::env;
+use std::fmt::Write as FmtWrite;
+use std::fs::{self, File};
+use std::io::Write;
+use std::path::PathBuf;
+use std::process;
+use std::sync::OnceLock;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::SystemTime;
+
+// Opt-in on-disk cache of compressed data, enabled by MAGISKBOOT_CACHE_DIR.
+// Entries are named after the SHA-256 of the input followed by every setting
+// that affects the encoder output. The modification time of an entry is its
+// last use; once the cache grows over MAGISKBOOT_CACHE_SIZE (in MB), the
+// least recently used entries are evicted.
+
+const DEFAULT_CACHE_SIZE_MB: u64 = 256;
+
+struct CompressCache {
+    dir: PathBuf,
+    limit: u64,
+}
+
+static CACHE: OnceLock<Option<CompressCache>> = OnceLock::new();
+
+// Make temporary file names unique among threads writing the same entry
+static TMP_SEQ: AtomicUsize = AtomicUsize::new(0);
+
+fn cache() -> Option<&'static CompressCache> {
+    CACHE
+        .get_or_init(|| {
+            let dir = env::var_os("MAGISKBOOT_CACHE_DIR").filter(|d| !d.is_empty())?;
+            let limit = env::var("MAGISKBOOT_CACHE_SIZE")
+                .ok()
+                .and_then(|s| s.parse::<u64>().ok())
+                .unwrap_or(DEFAULT_CACHE_SIZE_MB)
+                << 20;
+            fs::create_dir_all(&dir).ok()?;
+            Some(CompressCache {
+                dir: dir.into(),
+                limit,
+            })
+        })
+        .as_ref()
+}
+
+impl CompressCache {
+    fn get(&self, key: &str) -> Option<Vec<u8>> {
+        let path = self.dir.join(key);
+        let data = fs::read(&path).ok()?;
+        // Mark the entry as recently used
+        if let Ok(file) = File::options().write(true).open(&path) {
+            file.set_modified(SystemTime::now()).ok();
+        }
+        Some(data)
+    }
+
+    fn put(&self, key: &str, data: &[u8]) {
+        if data.len() as u64 > self.limit {
+            return;
+        }
+        // Write to a temporary file first so readers never see partial entries
+        let seq = TMP_SEQ.fetch_add(1, Ordering::Relaxed);
+        let tmp = self.dir.join(format!(".{}.{}.{}", key, process::id(), seq));
+        let res: std::io::Result<()> = try {
+            File::create(&tmp)?.write_all(data)?;
+            fs::rename(&tmp, self.dir.join(key))?;
+        };
+        if res.is_err() {
+            fs::remove_file(&tmp).ok();
+            return;
+        }
+        self.evict();
+    }
+
+    fn evict(&self) {
+        let Ok(dir) = fs::read_dir(&self.dir) else {
+            return;
+        };
+        let mut entries: Vec<(SystemTime, u64, PathBuf)> = dir
+            .filter_map(|e| {
+                let e = e.ok()?;
+                if e.file_name().as_encoded_bytes().starts_with(b".") {
+                    return None;
+                }
+                let meta = e.metadata().ok()?;
+                if !meta.is_file() {
+                    return None;
+                }
+                Some((meta.modified().ok()?, meta.len(), e.path()))
+            })
+            .collect();
+
+        let mut total: u64 = entries.iter().map(|e| e.1).sum();
+        if total <= self.limit {
+            return;
+        }
+        // Oldest first
+        entries.sort_by_key(|e| e.0);
+        for (_, len, path) in entries {
+            if total <= self.limit {
+                break;
+            }
+            // Another process may have already removed it
+            fs::remove_file(&path).ok();
+            total -= len;
+        }
+    }
+}
+
+pub(crate) fn cache_enabled() -> bool {
+    cache().is_some()
+}
+
+// Return the cached output of compressing input with the encoder described by
+// settings, or run compress and store its output in the cache.
+pub(crate) fn cached<F>(settings: &str, input: &[u8], compress: F) -> std::io::Result<Vec<u8>>
+where
+    F: FnOnce() -> std::io::Result<Vec<u8>>,
+{
+    let Some(cache) = cache() else {
+        return compress();
+    };
+
+    let mut digest = [0_u8; 32];
+    sha256_hash(input, &mut digest);
+    let mut key = String::with_capacity(digest.len() * 2 + 1 + settings.len());
+    for b in digest {
+        write!(key, "{b:02x}").ok();
+    }
+    key.push('-');
+    key.push_str(settings);
+
+    if let Some(out) = cache.get(&key) {
+        return Ok(out);
+    }
+    let out = compress()?;
+    cache.put(&key, &out);
+    Ok(out)
+}
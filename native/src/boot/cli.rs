@@ -1,10 +1,16 @@
-use crate::compress::{compress_cmd, decompress_cmd};
+use crate::batch::batch_cmd;
+use crate::compress::{
+    compress_cmd, decompress_cmd, fmt_has_blocks, fmt_has_level, set_block_mode, set_block_size,
+    set_level,
+};
 use crate::cpio::{cpio_commands, print_cpio_usage};
 use crate::dtb::{DtbAction, dtb_commands, print_dtb_usage};
-use crate::ffi::{BootImage, FileFormat, cleanup, repack, split_image_dtb, unpack};
+use crate::ffi::{BootImage, FileFormat, cleanup, patch_image, repack, split_image_dtb, unpack};
+use crate::parallel::set_thread_count;
 use crate::patch::hexpatch;
 use crate::payload::extract_boot_from_payload;
 use crate::sign::{sha1_hash, sign_boot_image};
+use crate::verity::hashtree_cmd;
 use argh::{CommandInfo, EarlyExit, FromArgs, SubCommand};
 use base::libc::umask;
 use base::nix::fcntl::OFlag;
@@ -12,6 +18,7 @@ use base::{
     CmdArgs, EarlyExitExt, LoggedResult, MappedFile, PositionalArgParser, ResultExt, Utf8CStr,
     Utf8CString, WriteExt, argh, cmdline_logging, cstr, log_err,
 };
+use cxx::UniquePtr;
 use std::ffi::c_char;
 use std::io::{Seek, SeekFrom, Write};
 use std::str::FromStr;
@@ -27,8 +34,10 @@ struct Cli {
 enum Action {
     Unpack(Unpack),
     Repack(Repack),
+    Patch(Patch),
     Verify(Verify),
     Sign(Sign),
+    Hashtree(Hashtree),
     Extract(Extract),
     HexPatch(HexPatch),
     Cpio(Cpio),
@@ -38,6 +47,7 @@ enum Action {
     Cleanup(Cleanup),
     Compress(Compress),
     Decompress(Decompress),
+    Batch(Batch),
 }
 
 #[derive(FromArgs)]
@@ -62,6 +72,17 @@ struct Repack {
     out: Option<Utf8CString>,
 }
 
+#[derive(FromArgs)]
+#[argh(subcommand, name = "patch")]
+struct Patch {
+    #[argh(positional)]
+    img: Utf8CString,
+    #[argh(positional)]
+    out: Utf8CString,
+    #[argh(positional)]
+    cmds: Vec<String>,
+}
+
 #[derive(FromArgs)]
 #[argh(subcommand, name = "verify")]
 struct Verify {
@@ -84,9 +105,26 @@ struct Sign {
     key: Option<Utf8CString>,
 }
 
+#[derive(FromArgs)]
+#[argh(subcommand, name = "hashtree")]
+struct Hashtree {
+    #[argh(option, short = 'n', long = none, default = "String::from(\"system\")")]
+    name: String,
+    #[argh(option, short = 's', long = none)]
+    salt: Option<String>,
+    #[argh(option, short = 'b', long = none, default = "4096")]
+    block_size: usize,
+    #[argh(option, short = 'p', long = none, default = "0")]
+    partition_size: u64,
+    #[argh(positional)]
+    img: Utf8CString,
+}
+
 #[derive(FromArgs)]
 #[argh(subcommand, name = "extract")]
 struct Extract {
+    #[argh(option, short = 's', long = none)]
+    source: Option<Utf8CString>,
     #[argh(positional)]
     payload: Utf8CString,
     #[argh(positional)]
@@ -146,10 +184,25 @@ struct Cleanup {}
 
 struct Compress {
     format: FileFormat,
+    threads: Option<usize>,
+    block_size: Option<usize>,
+    level: Option<i32>,
     file: Utf8CString,
     out: Option<Utf8CString>,
 }
 
+fn parse_size(s: &str) -> Result<usize, EarlyExit> {
+    let (num, shift) = match s.as_bytes().last() {
+        Some(b'k' | b'K') => (&s[..s.len() - 1], 10),
+        Some(b'm' | b'M') => (&s[..s.len() - 1], 20),
+        _ => (s, 0),
+    };
+    match num.parse::<usize>() {
+        Ok(n) if n > 0 => Ok(n << shift),
+        _ => Err(EarlyExit::from(format!("Invalid size: {s}\n"))),
+    }
+}
+
 impl FromArgs for Compress {
     fn from_args(command_name: &[&str], args: &[&str]) -> Result<Self, EarlyExit> {
         let cmd = command_name.last().copied().unwrap_or_default();
@@ -161,9 +214,38 @@ impl FromArgs for Compress {
             )));
         };
 
+        let mut threads = None;
+        let mut block_size = None;
+        let mut level = None;
+        let mut args = args;
+        while let [opt, val, rest @ ..] = args {
+            match *opt {
+                "-j" => match val.parse::<usize>() {
+                    Ok(n) if n > 0 => threads = Some(n),
+                    _ => return Err(EarlyExit::from(format!("Invalid thread count: {val}\n"))),
+                },
+                "-b" => block_size = Some(parse_size(val)?),
+                "-l" => match val.parse::<i32>() {
+                    Ok(n) => level = Some(n),
+                    _ => return Err(EarlyExit::from(format!("Invalid level: {val}\n"))),
+                },
+                _ => break,
+            }
+            args = rest;
+        }
+
+        if level.is_some() && !fmt_has_level(fmt) {
+            return Err(EarlyExit::from(format!(
+                "Compression level is not supported for {fmt}\n"
+            )));
+        }
+
         let mut iter = PositionalArgParser(args.iter());
         Ok(Compress {
             format: fmt,
+            threads,
+            block_size,
+            level,
             file: iter.required("infile")?,
             out: iter.last_optional()?,
         })
@@ -186,6 +268,15 @@ struct Decompress {
     out: Option<Utf8CString>,
 }
 
+#[derive(FromArgs)]
+#[argh(subcommand, name = "batch")]
+struct Batch {
+    #[argh(option, short = 'j', long = none)]
+    jobs: Option<usize>,
+    #[argh(positional)]
+    manifest: Utf8CString,
+}
+
 fn print_usage(cmd: &str) {
     eprintln!(
         r#"MagiskBoot - Boot Image Modification Tool
@@ -198,7 +289,8 @@ Supported actions:
     a file with its corresponding file name in the current directory.
     Supported components: kernel, kernel_dtb, ramdisk.cpio, second,
     dtb, extra, and recovery_dtbo.
-    By default, each component will be decompressed on-the-fly.
+    By default, each component will be decompressed on-the-fly, with all
+    components decompressed concurrently (see MAGISKBOOT_THREADS in repack).
     If '-n' is provided, all decompression operations will be skipped;
     each component will remain untouched, dumped in its original format.
     If '-h' is provided, the boot image header information will be
@@ -220,6 +312,33 @@ Supported actions:
     If '-n' is provided, all compression operations will be skipped.
     If env variable PATCHVBMETAFLAG is set to true, all disable flags in
     the boot image's vbmeta header will be set.
+    Components are compressed concurrently, using as many threads as
+    there are CPUs. Set env variable MAGISKBOOT_THREADS to override the
+    number of threads; '1' compresses the components one at a time.
+    If env variable MAGISKBOOT_CACHE_DIR is set, compressed components
+    are cached in that directory and reused when the same data is
+    compressed again with the same settings. The least recently used
+    entries are evicted once the cache exceeds MAGISKBOOT_CACHE_SIZE
+    megabytes (default: 256).
+    If env variable MAGISKBOOT_RAMDISK_AUTO is set to true, the ramdisk
+    is compressed with every format in MAGISKBOOT_RAMDISK_FORMATS in
+    parallel, and the smallest result is used. If MAGISKBOOT_RAMDISK_BUDGET
+    is set (e.g. 16M), the fastest to decompress format that fits in the
+    budget is used instead. By default, the candidates are the original
+    ramdisk format, lz4_legacy and gzip, which every kernel with initramfs
+    support for the original format is expected to handle. Only list
+    formats that the kernel is able to decompress. Ramdisks of
+    v4 boot images and vendor ramdisk tables keep their format.
+
+  patch <bootimg> <outbootimg> [commands...]
+    Run cpio commands on the ramdisk of <bootimg> and repack the result
+    to <outbootimg>, all in memory without any intermediate files.
+    Each command is a single argument; add quotes for each command.
+    See "cpio --help" for supported commands; 'backup -' uses the
+    original ramdisk as ORIG; 'test', 'exists' and 'ls' are not allowed,
+    run them with 'cpio' beforehand. All other components, including the
+    kernel, are copied from <bootimg> as is. For vendor boot images,
+    the default vendor ramdisk (ramdisk.cpio) is patched.
 
   verify <bootimg> [x509.pem]
     Check whether the boot image is signed with AVB 1.0 signature.
@@ -235,20 +354,49 @@ Supported actions:
     If the certificate/private key pair is not provided, the AOSP
     verity key bundled in the executable will be used.
 
-  extract <payload.bin> [partition] [outfile]
+  hashtree [-n name] [-s salt] [-b blocksize] [-p partsize] <img>
+    Build a SHA-256 dm-verity hash tree of <img> and append it with an
+    AVB hashtree footer, the same as 'avbtool add_hashtree_footer'.
+    Any existing AVB footer of <img> is replaced. The tree levels are
+    hashed on multiple threads (see MAGISKBOOT_THREADS in repack).
+    '-n' sets the partition name (default: 'system'), '-s' the salt as
+    hex (default: random), and '-b' the block size (default: 4096).
+    If '-p' is provided, the footer is placed at the end of a partition
+    of that many bytes. The vbmeta image in the footer is not signed.
+    The root digest and salt are printed for the dm-verity table.
+
+  extract [-s source] <payload.bin> [partition] [outfile]
     Extract [partition] from <payload.bin> to [outfile].
     If [outfile] is not specified, then output to '[partition].img'.
+    [partition] can be a comma separated list of partitions, or 'all'.
+    These are extracted together in one pass over <payload.bin>, and
+    [outfile] is then the directory for the '[partition].img' files
+    (default: current directory).
     If [partition] is not specified, then attempt to extract either
     'init_boot' or 'boot'. Which partition was chosen can be determined
     by whichever 'init_boot.img' or 'boot.img' exists.
-    <payload.bin> can be '-' to be STDIN.
+    <payload.bin> can also be an OTA zip, payload.bin is then read in
+    place from the zip without unpacking it.
+    <payload.bin> can be '-' to be STDIN. Unless read from STDIN, the
+    operations are decoded on multiple threads (see MAGISKBOOT_THREADS
+    in repack).
+    Delta (incremental) payloads are applied on top of the source image
+    [-s source], the partition image the OTA updates from. With multiple
+    partitions, [-s source] is a directory of '[partition].img' images;
+    partitions missing from it must not have any source operations.
+    SOURCE_COPY, SOURCE_BSDIFF and BROTLI_BSDIFF operations are supported,
+    puffdiff is not.
 
   hexpatch <file> <hexpattern1> <hexpattern2>
     Search <hexpattern1> in <file>, and replace it with <hexpattern2>
 
   cpio <incpio> [commands...]
     Do cpio commands to <incpio> (modifications are done in-place).
+    A modified <incpio> is replaced by a new file with the same mode,
+    owner and SELinux context; other hard links to it are not updated.
     Each command is a single argument; add quotes for each command.
+    <incpio> can be compressed, modifications are then recompressed in
+    the same format.
     See "cpio --help" for supported commands.
 
   dtb <file> <action> [args...]
@@ -266,31 +414,67 @@ Supported actions:
   cleanup
     Cleanup the current working directory
 
-  compress[=format] <infile> [outfile]
+  compress[=format] [-j THREADS] [-b SIZE] [-l LEVEL] <infile> [outfile]
     Compress <infile> with [format] to [outfile].
     <infile>/[outfile] can be '-' to be STDIN/STDOUT.
     If [format] is not specified, then gzip will be used.
     If [outfile] is not specified, then <infile> will be replaced
     with another file suffixed with a matching file extension.
+    By default the data is compressed on a single thread, so the output
+    does not depend on the host. With '-j' or '-b', it is split into
+    blocks that are compressed independently in parallel, which lowers
+    the compression ratio of xz and zopfli. '-j' sets the number of
+    compression threads (default: number of CPUs, or env variable
+    MAGISKBOOT_THREADS), and '-b' sets the size of the blocks (e.g. 8M).
+    LZ4 formats always use their standard block sizes.
+    '-j' and '-b' are supported for: {2}
+    '-l' sets the compression level (zstd default: 19), and is supported
+    for: {3}
     Supported formats:
     {1}
 
+  batch [-j JOBS] <manifest>
+    Run the commands listed in <manifest> concurrently in one process,
+    using up to JOBS workers (default: number of CPUs, or env variable
+    MAGISKBOOT_THREADS). The threads are shared out between the workers.
+    Each line is a command with its arguments, e.g.
+    'patch boot.img new-boot.img "add 0750 init magiskinit"'. Arguments
+    can be quoted with ' or ". Empty lines and lines starting with '#'
+    are ignored. <manifest> can be '-' to be STDIN.
+    unpack, repack, split and cleanup work on files in the current
+    directory and are not supported; use patch instead. Neither are
+    compress options, as they change process-wide settings.
+    Once all commands have finished, the result and time of each command
+    is reported. Return 0 if all commands succeeded, else 1.
+
   decompress <infile> [outfile]
     Detect format and decompress <infile> to [outfile].
     <infile>/[outfile] can be '-' to be STDIN/STDOUT.
     If [outfile] is not specified, then <infile> will be replaced
     with another file removing its archive format file extension.
+    Multi-block xz and lz4_legacy/lz4_lg files are decoded on multiple
+    threads (see MAGISKBOOT_THREADS in repack), unless read from STDIN.
     Supported formats:
     {1}
 "#,
         cmd,
-        FileFormat::formats()
+        FileFormat::formats(),
+        FileFormat::formats_with(fmt_has_blocks),
+        FileFormat::formats_with(fmt_has_level)
     );
 }
 
-fn verify_cmd(image: &Utf8CStr, cert: Option<&Utf8CStr>) -> bool {
-    let image = BootImage::new(image);
-    match cert {
+fn open_image(image: &Utf8CStr) -> LoggedResult<UniquePtr<BootImage>> {
+    let img = BootImage::new(image);
+    if img.is_null() {
+        return log_err!("Failed to parse boot image [{}]", image);
+    }
+    Ok(img)
+}
+
+fn verify_cmd(image: &Utf8CStr, cert: Option<&Utf8CStr>) -> LoggedResult<bool> {
+    let image = open_image(image)?;
+    Ok(match cert {
         None => {
             // Boot image parsing already checks if the image is signed
             image.is_signed()
@@ -299,7 +483,7 @@ fn verify_cmd(image: &Utf8CStr, cert: Option<&Utf8CStr>) -> bool {
             // Provide a custom certificate and re-verify
             image.verify(cert).is_ok()
         }
-    }
+    })
 }
 
 fn sign_cmd(
@@ -308,7 +492,7 @@ fn sign_cmd(
     cert: Option<&Utf8CStr>,
     key: Option<&Utf8CStr>,
 ) -> LoggedResult<()> {
-    let img = BootImage::new(image);
+    let img = open_image(image)?;
     let name = name.unwrap_or(cstr!("/boot"));
     let sig = sign_boot_image(img.payload(), name, cert, key)?;
     let tail_off = img.tail_off();
@@ -326,18 +510,12 @@ fn sign_cmd(
     Ok(())
 }
 
-fn boot_main(cmds: CmdArgs) -> LoggedResult<i32> {
-    let mut cmds = cmds.0;
-    if cmds.len() < 2 {
-        print_usage(cmds.first().unwrap_or(&"magiskboot"));
-        return log_err!();
-    }
-
+fn parse_cli(cmds: &mut [&str]) -> Result<Cli, EarlyExit> {
     if cmds[1].starts_with("--") {
         cmds[1] = &cmds[1][2..];
     }
 
-    let cli = if cmds[1].starts_with("compress=") {
+    if cmds[1].starts_with("compress=") {
         // Skip the main parser, directly parse the subcommand
         Compress::from_args(&cmds[..2], &cmds[2..]).map(|compress| Cli {
             action: Action::Compress(compress),
@@ -345,13 +523,56 @@ fn boot_main(cmds: CmdArgs) -> LoggedResult<i32> {
     } else {
         Cli::from_args(&[cmds[0]], &cmds[1..])
     }
-    .on_early_exit(|| match cmds[1] {
+}
+
+// Run a single command of a batch manifest. Commands that work on files in
+// the current directory, or change process-wide settings, cannot run
+// concurrently with others.
+fn batch_job(args: &[&str]) -> LoggedResult<i32> {
+    if args.is_empty() {
+        return log_err!();
+    }
+    let mut cmds = vec!["magiskboot"];
+    cmds.extend_from_slice(args);
+    let cli = match parse_cli(&mut cmds) {
+        Ok(cli) => cli,
+        Err(e) => return log_err!("{}", e.output.trim_end()),
+    };
+    match &cli.action {
+        Action::Unpack(_) | Action::Repack(_) | Action::Split(_) | Action::Cleanup(_) => {
+            return log_err!("{}: not supported in batch, use patch instead", args[0]);
+        }
+        Action::Compress(Compress {
+            threads,
+            block_size,
+            level,
+            ..
+        }) if threads.is_some() || block_size.is_some() || level.is_some() => {
+            return log_err!("{}: compress options are not supported in batch", args[0]);
+        }
+        Action::Batch(_) => return log_err!("batch: cannot be nested"),
+        _ => {}
+    }
+    run_action(cli.action)
+}
+
+fn boot_main(cmds: CmdArgs) -> LoggedResult<i32> {
+    let mut cmds = cmds.0;
+    if cmds.len() < 2 {
+        print_usage(cmds.first().unwrap_or(&"magiskboot"));
+        return log_err!();
+    }
+
+    let cli = parse_cli(&mut cmds).on_early_exit(|| match cmds[1] {
         "dtb" => print_dtb_usage(),
         "cpio" => print_cpio_usage(),
         _ => print_usage(cmds[0]),
     });
+    run_action(cli.action)
+}
 
-    match cli.action {
+fn run_action(action: Action) -> LoggedResult<i32> {
+    match action {
         Action::Unpack(Unpack {
             no_decompress,
             dump_header,
@@ -364,14 +585,19 @@ fn boot_main(cmds: CmdArgs) -> LoggedResult<i32> {
             img,
             out,
         }) => {
-            repack(
+            if !repack(
                 &img,
                 out.as_deref().unwrap_or(cstr!("new-boot.img")),
                 no_compress,
-            );
+            ) {
+                return log_err!("Failed to repack");
+            }
+        }
+        Action::Patch(Patch { img, out, cmds }) => {
+            return Ok(patch_image(&img, &out, &cmds));
         }
         Action::Verify(Verify { img, cert }) => {
-            if !verify_cmd(&img, cert.as_deref()) {
+            if !verify_cmd(&img, cert.as_deref())? {
                 return log_err!();
             }
         }
@@ -383,15 +609,27 @@ fn boot_main(cmds: CmdArgs) -> LoggedResult<i32> {
         }) => {
             sign_cmd(&img, name.as_deref(), cert.as_deref(), key.as_deref())?;
         }
+        Action::Hashtree(Hashtree {
+            name,
+            salt,
+            block_size,
+            partition_size,
+            img,
+        }) => {
+            hashtree_cmd(&img, &name, salt.as_deref(), block_size, partition_size)
+                .log_with_msg(|w| w.write_str("Failed to build hash tree"))?;
+        }
         Action::Extract(Extract {
             payload,
             partition,
             outfile,
+            source,
         }) => {
             extract_boot_from_payload(
                 &payload,
                 partition.as_ref().map(AsRef::as_ref),
                 outfile.as_ref().map(AsRef::as_ref),
+                source.as_ref().map(AsRef::as_ref),
             )
             .log_with_msg(|w| w.write_str("Failed to extract from payload"))?;
         }
@@ -401,7 +639,8 @@ fn boot_main(cmds: CmdArgs) -> LoggedResult<i32> {
             }
         }
         Action::Cpio(Cpio { file, cmds }) => {
-            cpio_commands(&file, &cmds).log_with_msg(|w| w.write_str("Failed to process cpio"))?;
+            return cpio_commands(&file, &cmds)
+                .log_with_msg(|w| w.write_str("Failed to process cpio"));
         }
         Action::Dtb(Dtb { file, action }) => {
             return dtb_commands(&file, &action)
@@ -430,9 +669,29 @@ fn boot_main(cmds: CmdArgs) -> LoggedResult<i32> {
         Action::Decompress(Decompress { file, out }) => {
             decompress_cmd(&file, out.as_deref())?;
         }
-        Action::Compress(Compress { format, file, out }) => {
+        Action::Compress(Compress {
+            format,
+            threads,
+            block_size,
+            level,
+            file,
+            out,
+        }) => {
+            if let Some(threads) = threads {
+                set_thread_count(threads);
+            }
+            if let Some(block_size) = block_size {
+                set_block_size(block_size);
+            }
+            if let Some(level) = level {
+                set_level(level);
+            }
+            set_block_mode(threads.is_some() || block_size.is_some());
             compress_cmd(format, &file, out.as_deref())?;
         }
+        Action::Batch(Batch { jobs, manifest }) => {
+            return batch_cmd(&manifest, jobs, |args| batch_job(args).unwrap_or(1));
+        }
     }
     Ok(0)
 }
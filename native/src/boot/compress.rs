@@ -1,7 +1,11 @@
+use crate::cache::{cache_enabled, cached};
+use crate::deflate::deflate_unfinish;
 use crate::ffi::{FileFormat, check_fmt};
+use crate::parallel::{par_for_each_mut, par_map, thread_count};
 use base::nix::fcntl::OFlag;
 use base::{
-    Chunker, FileOrStd, LoggedResult, ReadExt, ResultExt, Utf8CStr, Utf8CString, WriteExt, log_err,
+    FileOrStd, LoggedResult, MappedFile, ReadExt, ResultExt, Utf8CStr, Utf8CString, WriteExt,
+    log_err,
 };
 use bzip2::Compression as BzCompression;
 use bzip2::read::BzDecoder;
@@ -9,6 +13,7 @@ use bzip2::write::BzEncoder;
 use flate2::Compression as GzCompression;
 use flate2::read::MultiGzDecoder;
 use flate2::write::GzEncoder;
+use flate2::{Compress, Crc, FlushCompress, Status};
 use lz4::block::CompressionMode;
 use lz4::liblz4::BlockChecksum;
 use lz4::{
@@ -16,7 +21,7 @@ use lz4::{
     EncoderBuilder as LZ4FrameEncoderBuilder,
 };
 use lzma_rust2::{CheckType, LzmaOptions, LzmaReader, LzmaWriter, XzOptions, XzReader, XzWriter};
-use std::cmp::min;
+use std::cmp::{max, min};
 use std::fmt::Write as FmtWrite;
 use std::fs::File;
 use std::io::{BufWriter, Cursor, Read, Write};
@@ -24,7 +29,13 @@ use std::mem::ManuallyDrop;
 use std::num::NonZeroU64;
 use std::ops::DerefMut;
 use std::os::fd::{FromRawFd, RawFd};
-use zopfli::{BlockType, GzipEncoder as ZopFliEncoder, Options as ZopfliOptions};
+use std::sync::atomic::{AtomicBool, AtomicI32, AtomicUsize, Ordering};
+use zopfli::{
+    BlockType, Format as ZopfliFormat, GzipEncoder as ZopFliEncoder, Options as ZopfliOptions,
+};
+use zstd::stream::raw::CParameter as ZstdParameter;
+use zstd::stream::read::Decoder as ZstdDecoder;
+use zstd::stream::write::Encoder as ZstdEncoder;
 
 pub trait WriteFinish<W: Write>: Write {
     fn finish(self: Box<Self>) -> std::io::Result<W>;
@@ -42,7 +53,13 @@ macro_rules! finish_impl {
     )*}
 }
 
-finish_impl!(GzEncoder<W>, BzEncoder<W>, XzWriter<W>, LzmaWriter<W>);
+finish_impl!(
+    GzEncoder<W>,
+    BzEncoder<W>,
+    XzWriter<W>,
+    LzmaWriter<W>,
+    ZstdEncoder<'_, W>
+);
 
 impl<W: Write> WriteFinish<W> for BufWriter<ZopFliEncoder<W>> {
     fn finish(self: Box<Self>) -> std::io::Result<W> {
@@ -59,6 +76,88 @@ impl<W: Write> WriteFinish<W> for LZ4FrameEncoder<W> {
     }
 }
 
+// BlockBatch
+//
+// Input buffer of the multi-threaded encoders. The data is split into blocks
+// that are compressed independently, one batch of blocks at a time. The buffer
+// only grows as data comes in, so small inputs never allocate a full batch.
+
+struct BlockBatch {
+    buf: Vec<u8>,
+    block_size: usize,
+    batch_size: usize,
+}
+
+impl BlockBatch {
+    fn new(block_size: usize, threads: usize) -> Self {
+        let batch_size = block_size * threads;
+        BlockBatch {
+            buf: Vec::new(),
+            block_size,
+            batch_size,
+        }
+    }
+
+    // Buffer as much input as the batch can hold, and return the rest
+    fn add_data<'a>(&mut self, buf: &'a [u8]) -> &'a [u8] {
+        let len = min(self.batch_size - self.buf.len(), buf.len());
+        let want = self.buf.len() + len;
+        if want > self.buf.capacity() {
+            let cap = min(max(want, self.buf.capacity() * 2), self.batch_size);
+            self.buf.reserve_exact(cap - self.buf.len());
+        }
+        self.buf.extend_from_slice(&buf[..len]);
+        &buf[len..]
+    }
+
+    fn is_full(&self) -> bool {
+        self.buf.len() == self.batch_size
+    }
+
+    fn is_empty(&self) -> bool {
+        self.buf.is_empty()
+    }
+
+    // Run f on every block in parallel, results are in the same order as the input
+    fn encode<R: Send>(&mut self, f: impl Fn(&[u8]) -> R + Sync) -> Vec<R> {
+        let chunks: Vec<&[u8]> = self.buf.chunks(self.block_size).collect();
+        let results = par_map(&chunks, |chunk| f(chunk));
+        self.buf.clear();
+        results
+    }
+
+    // Same as encode, but f also gets up to dict_size bytes of the data preceding
+    // each block, and whether the block is the last one of this batch.
+    fn encode_with_dict<R: Send>(
+        &mut self,
+        dict: &mut Vec<u8>,
+        dict_size: usize,
+        f: impl Fn(&[u8], &[u8], bool) -> R + Sync,
+    ) -> Vec<R> {
+        let count = self.buf.len().div_ceil(self.block_size);
+        let blocks: Vec<(&[u8], &[u8], bool)> = self
+            .buf
+            .chunks(self.block_size)
+            .enumerate()
+            .map(|(i, chunk)| {
+                let start = i * self.block_size;
+                let prev = if start == 0 {
+                    dict.as_slice()
+                } else {
+                    &self.buf[start.saturating_sub(dict_size)..start]
+                };
+                (prev, chunk, i + 1 == count)
+            })
+            .collect();
+        let results = par_map(&blocks, |&(prev, chunk, last)| f(prev, chunk, last));
+
+        dict.extend_from_slice(&self.buf);
+        dict.drain(..dict.len().saturating_sub(dict_size));
+        self.buf.clear();
+        results
+    }
+}
+
 // LZ4BlockArchive format
 //
 // len:  |   4   |          4            |           n           | ... |           4             |
@@ -70,37 +169,46 @@ const LZ4_BLOCK_SIZE: usize = 0x800000;
 const LZ4HC_CLEVEL_MAX: i32 = 12;
 const LZ4_MAGIC: u32 = 0x184c2102;
 
+fn lz4_compress_block(chunk: &[u8], level: i32) -> std::io::Result<Vec<u8>> {
+    let mut out = vec![0_u8; lz4::block::compress_bound(chunk.len())?];
+    let len = lz4::block::compress_to_buffer(
+        chunk,
+        Some(CompressionMode::HIGHCOMPRESSION(level)),
+        false,
+        &mut out,
+    )?;
+    out.truncate(len);
+    Ok(out)
+}
+
 struct LZ4BlockEncoder<W: Write> {
     write: W,
-    chunker: Chunker,
-    out_buf: Box<[u8]>,
+    batch: BlockBatch,
     total: u32,
     is_lg: bool,
 }
 
 impl<W: Write> LZ4BlockEncoder<W> {
     fn new(write: W, is_lg: bool) -> Self {
-        let out_sz = lz4::block::compress_bound(LZ4_BLOCK_SIZE).unwrap_or(LZ4_BLOCK_SIZE);
         LZ4BlockEncoder {
             write,
-            chunker: Chunker::new(LZ4_BLOCK_SIZE),
-            // SAFETY: all bytes will be initialized before it is used
-            out_buf: unsafe { Box::new_uninit_slice(out_sz).assume_init() },
+            batch: BlockBatch::new(LZ4_BLOCK_SIZE, thread_count()),
             total: 0,
             is_lg,
         }
     }
 
-    fn encode_block(write: &mut W, out_buf: &mut [u8], chunk: &[u8]) -> std::io::Result<()> {
-        let compressed_size = lz4::block::compress_to_buffer(
-            chunk,
-            Some(CompressionMode::HIGHCOMPRESSION(LZ4HC_CLEVEL_MAX)),
-            false,
-            out_buf,
-        )?;
-        let block_size = compressed_size as u32;
-        write.write_pod(&block_size)?;
-        write.write_all(&out_buf[..compressed_size])
+    fn encode_batch(&mut self) -> std::io::Result<()> {
+        for block in self
+            .batch
+            .encode(|chunk| lz4_compress_block(chunk, LZ4HC_CLEVEL_MAX))
+        {
+            let block = block?;
+            let block_size = block.len() as u32;
+            self.write.write_pod(&block_size)?;
+            self.write.write_all(&block)?;
+        }
+        Ok(())
     }
 }
 
@@ -122,10 +230,9 @@ impl<W: Write> Write for LZ4BlockEncoder<W> {
 
         self.total += buf.len() as u32;
         while !buf.is_empty() {
-            let (b, chunk) = self.chunker.add_data(buf);
-            buf = b;
-            if let Some(chunk) = chunk {
-                Self::encode_block(&mut self.write, &mut self.out_buf, chunk)?;
+            buf = self.batch.add_data(buf);
+            if self.batch.is_full() {
+                self.encode_batch()?;
             }
         }
         Ok(())
@@ -134,10 +241,7 @@ impl<W: Write> Write for LZ4BlockEncoder<W> {
 
 impl<W: Write> WriteFinish<W> for LZ4BlockEncoder<W> {
     fn finish(mut self: Box<Self>) -> std::io::Result<W> {
-        let chunk = self.chunker.get_available();
-        if !chunk.is_empty() {
-            Self::encode_block(&mut self.write, &mut self.out_buf, chunk)?;
-        }
+        self.encode_batch()?;
         if self.is_lg {
             self.write.write_pod(&self.total)?;
         }
@@ -145,6 +249,221 @@ impl<W: Write> WriteFinish<W> for LZ4BlockEncoder<W> {
     }
 }
 
+// LZ4FrameBlockEncoder
+//
+// Multi-threaded LZ4 frame encoder. All blocks are independent and checksummed,
+// so they can be compressed in parallel and written out in order.
+//
+// len:  |   4   |       3        |  4   |  n   |    4     | ... |    4     |        4         |
+// data: | magic | FLG | BD | HC | size | data | checksum | ... | end mark | content checksum |
+
+const LZ4F_MAGIC: u32 = 0x184d2204;
+const LZ4F_BLOCK_SIZE: usize = 0x400000;
+const LZ4F_CLEVEL: i32 = 9;
+// Version 01, independent blocks, block checksum, content checksum
+const LZ4F_FLG: u8 = 0x74;
+// Max block size 4MB
+const LZ4F_BD: u8 = 0x70;
+// Set in the block size field if the block is stored uncompressed
+const LZ4F_UNCOMPRESSED: u32 = 0x80000000;
+
+struct LZ4FrameBlockEncoder<W: Write> {
+    write: W,
+    batch: BlockBatch,
+    content_hash: Xxh32,
+    header_written: bool,
+}
+
+impl<W: Write> LZ4FrameBlockEncoder<W> {
+    fn new(write: W, threads: usize) -> Self {
+        LZ4FrameBlockEncoder {
+            write,
+            batch: BlockBatch::new(LZ4F_BLOCK_SIZE, threads),
+            content_hash: Xxh32::new(0),
+            header_written: false,
+        }
+    }
+
+    fn encode_block(chunk: &[u8]) -> std::io::Result<Vec<u8>> {
+        let compressed = lz4_compress_block(chunk, LZ4F_CLEVEL)?;
+        let (block_size, data) = if compressed.len() < chunk.len() {
+            (compressed.len() as u32, compressed.as_slice())
+        } else {
+            (chunk.len() as u32 | LZ4F_UNCOMPRESSED, chunk)
+        };
+        let mut block = Vec::with_capacity(data.len() + 8);
+        block.extend_from_slice(&block_size.to_le_bytes());
+        block.extend_from_slice(data);
+        block.extend_from_slice(&Xxh32::hash(data).to_le_bytes());
+        Ok(block)
+    }
+
+    fn write_header(&mut self) -> std::io::Result<()> {
+        if !self.header_written {
+            let desc = [LZ4F_FLG, LZ4F_BD];
+            let hc = (Xxh32::hash(&desc) >> 8) as u8;
+            self.write.write_pod(&LZ4F_MAGIC)?;
+            self.write.write_all(&desc)?;
+            self.write.write_all(&[hc])?;
+            self.header_written = true;
+        }
+        Ok(())
+    }
+
+    fn encode_batch(&mut self) -> std::io::Result<()> {
+        self.write_header()?;
+        for block in self.batch.encode(Self::encode_block) {
+            self.write.write_all(&block?)?;
+        }
+        Ok(())
+    }
+}
+
+impl<W: Write> Write for LZ4FrameBlockEncoder<W> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        self.write_all(buf)?;
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        Ok(())
+    }
+
+    fn write_all(&mut self, mut buf: &[u8]) -> std::io::Result<()> {
+        self.content_hash.update(buf);
+        while !buf.is_empty() {
+            buf = self.batch.add_data(buf);
+            if self.batch.is_full() {
+                self.encode_batch()?;
+            }
+        }
+        Ok(())
+    }
+}
+
+impl<W: Write> WriteFinish<W> for LZ4FrameBlockEncoder<W> {
+    fn finish(mut self: Box<Self>) -> std::io::Result<W> {
+        self.encode_batch()?;
+        // End mark
+        self.write.write_pod(&0_u32)?;
+        self.write.write_pod(&self.content_hash.digest())?;
+        Ok(self.write)
+    }
+}
+
+// Xxh32
+//
+// The XXH32 hash used for LZ4 frame checksums
+
+const XXH_PRIME32_1: u32 = 0x9e3779b1;
+const XXH_PRIME32_2: u32 = 0x85ebca77;
+const XXH_PRIME32_3: u32 = 0xc2b2ae3d;
+const XXH_PRIME32_4: u32 = 0x27d4eb2f;
+const XXH_PRIME32_5: u32 = 0x165667b1;
+
+struct Xxh32 {
+    seed: u32,
+    acc: [u32; 4],
+    buf: [u8; 16],
+    buf_len: usize,
+    total: u64,
+}
+
+impl Xxh32 {
+    fn new(seed: u32) -> Self {
+        Xxh32 {
+            seed,
+            acc: [
+                seed.wrapping_add(XXH_PRIME32_1).wrapping_add(XXH_PRIME32_2),
+                seed.wrapping_add(XXH_PRIME32_2),
+                seed,
+                seed.wrapping_sub(XXH_PRIME32_1),
+            ],
+            buf: [0; 16],
+            buf_len: 0,
+            total: 0,
+        }
+    }
+
+    fn hash(data: &[u8]) -> u32 {
+        let mut h = Xxh32::new(0);
+        h.update(data);
+        h.digest()
+    }
+
+    fn read_u32(b: &[u8]) -> u32 {
+        u32::from_le_bytes([b[0], b[1], b[2], b[3]])
+    }
+
+    fn round(acc: u32, input: u32) -> u32 {
+        acc.wrapping_add(input.wrapping_mul(XXH_PRIME32_2))
+            .rotate_left(13)
+            .wrapping_mul(XXH_PRIME32_1)
+    }
+
+    fn stripe(acc: &mut [u32; 4], stripe: &[u8]) {
+        for (i, a) in acc.iter_mut().enumerate() {
+            *a = Self::round(*a, Self::read_u32(&stripe[i * 4..]));
+        }
+    }
+
+    fn update(&mut self, mut data: &[u8]) {
+        self.total += data.len() as u64;
+        if self.buf_len > 0 {
+            let len = min(16 - self.buf_len, data.len());
+            self.buf[self.buf_len..self.buf_len + len].copy_from_slice(&data[..len]);
+            self.buf_len += len;
+            data = &data[len..];
+            if self.buf_len < 16 {
+                return;
+            }
+            Self::stripe(&mut self.acc, &self.buf);
+            self.buf_len = 0;
+        }
+        let mut stripes = data.chunks_exact(16);
+        for stripe in &mut stripes {
+            Self::stripe(&mut self.acc, stripe);
+        }
+        let rest = stripes.remainder();
+        self.buf[..rest.len()].copy_from_slice(rest);
+        self.buf_len = rest.len();
+    }
+
+    fn digest(&self) -> u32 {
+        let mut h = if self.total >= 16 {
+            let [a, b, c, d] = self.acc;
+            a.rotate_left(1)
+                .wrapping_add(b.rotate_left(7))
+                .wrapping_add(c.rotate_left(12))
+                .wrapping_add(d.rotate_left(18))
+        } else {
+            self.seed.wrapping_add(XXH_PRIME32_5)
+        };
+        h = h.wrapping_add(self.total as u32);
+
+        let mut words = self.buf[..self.buf_len].chunks_exact(4);
+        for w in &mut words {
+            h = h
+                .wrapping_add(Self::read_u32(w).wrapping_mul(XXH_PRIME32_3))
+                .rotate_left(17)
+                .wrapping_mul(XXH_PRIME32_4);
+        }
+        for b in words.remainder() {
+            h = h
+                .wrapping_add((*b as u32).wrapping_mul(XXH_PRIME32_5))
+                .rotate_left(11)
+                .wrapping_mul(XXH_PRIME32_1);
+        }
+
+        h ^= h >> 15;
+        h = h.wrapping_mul(XXH_PRIME32_2);
+        h ^= h >> 13;
+        h = h.wrapping_mul(XXH_PRIME32_3);
+        h ^= h >> 16;
+        h
+    }
+}
+
 // LZ4BlockDecoder
 
 struct LZ4BlockDecoder<R: Read> {
@@ -216,47 +535,740 @@ impl<R: Read> Read for LZ4BlockDecoder<R> {
     }
 }
 
+// XzBlockEncoder
+//
+// The input is split into blocks that are compressed independently on worker threads.
+// All blocks are then combined into a single standard multi-block XZ stream.
+//
+// len:  |   12   |   n   | ... |   n   |   n   |   12   |
+// data: | header | block | ... | block | index | footer |
+
+const XZ_BLOCK_SIZE: usize = 0x800000;
+const XZ_HEADER_MAGIC: &[u8] = b"\xfd7zXZ\0";
+const XZ_FOOTER_MAGIC: &[u8] = b"YZ";
+// No flags, CRC32 check
+const XZ_STREAM_FLAGS: [u8; 2] = [0x00, 0x01];
+
+// Block size of multi-threaded encoders, 0 means the format's default
+static BLOCK_SIZE: AtomicUsize = AtomicUsize::new(0);
+
+pub(crate) fn set_block_size(size: usize) {
+    BLOCK_SIZE.store(size, Ordering::Relaxed);
+}
+
+fn block_size_or(default: usize) -> usize {
+    match BLOCK_SIZE.load(Ordering::Relaxed) {
+        0 => default,
+        n => n,
+    }
+}
+
+// Output is only split into blocks compressed on multiple threads when asked
+// for with compress -j or -b. By default every encoder runs serially, so that
+// the output never depends on the number of threads of the host, and XZ and
+// zopfli keep the matches across block boundaries. zImage repacking relies on
+// zopfli beating gzip -9 by a margin.
+static BLOCK_MODE: AtomicBool = AtomicBool::new(false);
+
+pub(crate) fn set_block_mode(enabled: bool) {
+    BLOCK_MODE.store(enabled, Ordering::Relaxed);
+}
+
+fn block_mode() -> bool {
+    BLOCK_MODE.load(Ordering::Relaxed)
+}
+
+// Whether get_encoder has a block encoder for the format, used with compress -j or -b
+pub(crate) fn fmt_has_blocks(format: FileFormat) -> bool {
+    !matches!(format, FileFormat::LZMA | FileFormat::BZIP2)
+}
+
+// Whether the encoder of the format takes the level of compress -l
+pub(crate) fn fmt_has_level(format: FileFormat) -> bool {
+    format == FileFormat::ZSTD
+}
+
+// Number of threads of a single encoder
+fn encoder_threads() -> usize {
+    if block_mode() { thread_count() } else { 1 }
+}
+
+// Compression level of encoders that support it, 0 means the format's default
+static LEVEL: AtomicI32 = AtomicI32::new(0);
+
+pub(crate) fn set_level(level: i32) {
+    LEVEL.store(level, Ordering::Relaxed);
+}
+
+fn level_or(default: i32) -> i32 {
+    match LEVEL.load(Ordering::Relaxed) {
+        0 => default,
+        n => n,
+    }
+}
+
+fn xz_options(max_dict_size: Option<usize>) -> XzOptions {
+    let mut opt = XzOptions::with_preset(9);
+    opt.set_check_sum_type(CheckType::Crc32);
+    if let Some(size) = max_dict_size {
+        // A dictionary larger than a block is only a waste of memory
+        let size = size.next_power_of_two().clamp(0x10000, 1 << 30) as u32;
+        opt.lzma_options.dict_size = min(opt.lzma_options.dict_size, size);
+    }
+    opt
+}
+
+fn zopfli_options() -> ZopfliOptions {
+    // These options are already better than gzip -9
+    ZopfliOptions {
+        iteration_count: NonZeroU64::new(1).unwrap(),
+        maximum_block_splits: 1,
+        ..Default::default()
+    }
+}
+
+fn crc32(data: &[u8]) -> u32 {
+    let mut crc = Crc::new();
+    crc.update(data);
+    crc.sum()
+}
+
+fn xz_write_varint(out: &mut Vec<u8>, mut n: u64) {
+    while n >= 0x80 {
+        out.push((n as u8) | 0x80);
+        n >>= 7;
+    }
+    out.push(n as u8);
+}
+
+fn xz_read_varint(buf: &mut &[u8]) -> std::io::Result<u64> {
+    let mut n = 0_u64;
+    for i in 0..9 {
+        let Some((b, rest)) = buf.split_first() else {
+            break;
+        };
+        *buf = rest;
+        n |= ((b & 0x7f) as u64) << (i * 7);
+        if b & 0x80 == 0 {
+            return Ok(n);
+        }
+    }
+    Err(std::io::Error::new(
+        std::io::ErrorKind::InvalidData,
+        "invalid xz varint",
+    ))
+}
+
+struct XzBlock {
+    // Block header, compressed data, padding, and check
+    data: Vec<u8>,
+    unpadded_size: u64,
+    uncompressed_size: u64,
+}
+
+struct XzBlockEncoder<W: Write> {
+    write: W,
+    batch: BlockBatch,
+    // (unpadded size, uncompressed size) of each block, used for the index
+    records: Vec<(u64, u64)>,
+    header_written: bool,
+}
+
+impl<W: Write> XzBlockEncoder<W> {
+    fn new(write: W, block_size: usize, threads: usize) -> Self {
+        XzBlockEncoder {
+            write,
+            batch: BlockBatch::new(block_size, threads),
+            records: Vec::new(),
+            header_written: false,
+        }
+    }
+
+    fn encode_block(data: &[u8]) -> std::io::Result<XzBlock> {
+        // Compress as a single-block stream, then strip out everything except the block
+        let mut xz = XzWriter::new(Vec::new(), xz_options(Some(data.len())))?;
+        xz.write_all(data)?;
+        let stream = xz.finish()?;
+
+        let invalid = || std::io::Error::new(std::io::ErrorKind::InvalidData, "invalid xz block");
+        if stream.len() < 24 || !stream.ends_with(XZ_FOOTER_MAGIC) {
+            return Err(invalid());
+        }
+        let footer = &stream[stream.len() - 12..];
+        let backward_size = u32::from_le_bytes([footer[4], footer[5], footer[6], footer[7]]);
+        let index_size = (backward_size as usize + 1) * 4;
+        let block_end = stream
+            .len()
+            .checked_sub(12 + index_size)
+            .filter(|end| *end > 12)
+            .ok_or_else(invalid)?;
+
+        // Skip the index indicator
+        let mut index = &stream[block_end + 1..];
+        if xz_read_varint(&mut index)? != 1 {
+            return Err(invalid());
+        }
+        let unpadded_size = xz_read_varint(&mut index)?;
+        let uncompressed_size = xz_read_varint(&mut index)?;
+
+        Ok(XzBlock {
+            data: stream[12..block_end].to_vec(),
+            unpadded_size,
+            uncompressed_size,
+        })
+    }
+
+    fn write_header(&mut self) -> std::io::Result<()> {
+        if !self.header_written {
+            self.write.write_all(XZ_HEADER_MAGIC)?;
+            self.write.write_all(&XZ_STREAM_FLAGS)?;
+            self.write
+                .write_all(&crc32(&XZ_STREAM_FLAGS).to_le_bytes())?;
+            self.header_written = true;
+        }
+        Ok(())
+    }
+
+    fn encode_batch(&mut self) -> std::io::Result<()> {
+        self.write_header()?;
+        for block in self.batch.encode(Self::encode_block) {
+            let block = block?;
+            self.write.write_all(&block.data)?;
+            self.records
+                .push((block.unpadded_size, block.uncompressed_size));
+        }
+        Ok(())
+    }
+}
+
+impl<W: Write> Write for XzBlockEncoder<W> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        self.write_all(buf)?;
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        Ok(())
+    }
+
+    fn write_all(&mut self, mut buf: &[u8]) -> std::io::Result<()> {
+        while !buf.is_empty() {
+            buf = self.batch.add_data(buf);
+            if self.batch.is_full() {
+                self.encode_batch()?;
+            }
+        }
+        Ok(())
+    }
+}
+
+impl<W: Write> WriteFinish<W> for XzBlockEncoder<W> {
+    fn finish(mut self: Box<Self>) -> std::io::Result<W> {
+        self.encode_batch()?;
+
+        // Index
+        let mut index = vec![0_u8];
+        xz_write_varint(&mut index, self.records.len() as u64);
+        for (unpadded_size, uncompressed_size) in &self.records {
+            xz_write_varint(&mut index, *unpadded_size);
+            xz_write_varint(&mut index, *uncompressed_size);
+        }
+        index.resize(index.len().next_multiple_of(4), 0);
+        let index_crc = crc32(&index);
+        index.extend_from_slice(&index_crc.to_le_bytes());
+        self.write.write_all(&index)?;
+
+        // Footer
+        let mut footer = [0_u8; 12];
+        let backward_size = (index.len() / 4 - 1) as u32;
+        footer[4..8].copy_from_slice(&backward_size.to_le_bytes());
+        footer[8..10].copy_from_slice(&XZ_STREAM_FLAGS);
+        footer[10..12].copy_from_slice(XZ_FOOTER_MAGIC);
+        let footer_crc = crc32(&footer[4..10]);
+        footer[..4].copy_from_slice(&footer_crc.to_le_bytes());
+        self.write.write_all(&footer)?;
+
+        Ok(self.write)
+    }
+}
+
+// GzipBlockEncoder
+//
+// pigz style multi-threaded gzip encoder. Each block is deflated independently and
+// terminated with an empty stored block (a sync flush), so that all blocks can be
+// concatenated into a single deflate stream. With zlib, every block is primed with
+// the last 32K of the data preceding it, just like a continuous stream. zopfli
+// blocks have no such priming, so they are only used in block mode.
+//
+// len:  |   10   |   n   | ... |   n   |   4   |   4   |
+// data: | header | block | ... | block | crc32 | isize |
+
+const GZIP_BLOCK_SIZE: usize = 0x20000;
+const ZOPFLI_BLOCK_SIZE: usize = 0x100000;
+const DEFLATE_WINDOW_SIZE: usize = 0x8000;
+// No flags, no mtime, maximum compression, unknown OS
+const GZIP_HEADER: [u8; 10] = [0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0xff];
+// An empty final block with fixed Huffman codes
+const DEFLATE_EMPTY_FINAL: [u8; 2] = [0x03, 0x00];
+
+struct GzipBlockEncoder<W: Write> {
+    write: W,
+    batch: BlockBatch,
+    dict: Vec<u8>,
+    crc: Crc,
+    zopfli: bool,
+    header_written: bool,
+}
+
+impl<W: Write> GzipBlockEncoder<W> {
+    fn new(write: W, zopfli: bool, threads: usize) -> Self {
+        let block_size = if zopfli {
+            block_size_or(ZOPFLI_BLOCK_SIZE)
+        } else {
+            block_size_or(GZIP_BLOCK_SIZE)
+        };
+        GzipBlockEncoder {
+            write,
+            batch: BlockBatch::new(block_size, threads),
+            dict: Vec::new(),
+            crc: Crc::new(),
+            zopfli,
+            header_written: false,
+        }
+    }
+
+    fn deflate_block(dict: &[u8], chunk: &[u8], last: bool) -> std::io::Result<Vec<u8>> {
+        let mut z = Compress::new(GzCompression::best(), false);
+        if !dict.is_empty() {
+            z.set_dictionary(dict).map_err(std::io::Error::other)?;
+        }
+        let flush = if last {
+            FlushCompress::Finish
+        } else {
+            FlushCompress::Sync
+        };
+        let mut out = Vec::with_capacity(chunk.len() + chunk.len() / 8 + 64);
+        loop {
+            if out.len() == out.capacity() {
+                out.reserve(chunk.len() / 8 + 64);
+            }
+            let status = z
+                .compress_vec(&chunk[z.total_in() as usize..], &mut out, flush)
+                .map_err(std::io::Error::other)?;
+            let done = if last {
+                status == Status::StreamEnd
+            } else {
+                z.total_in() as usize == chunk.len() && out.len() < out.capacity()
+            };
+            if done {
+                return Ok(out);
+            }
+        }
+    }
+
+    fn zopfli_block(chunk: &[u8], last: bool) -> std::io::Result<Vec<u8>> {
+        let mut out = Vec::new();
+        zopfli::compress(zopfli_options(), ZopfliFormat::Deflate, chunk, &mut out)?;
+        if last {
+            Ok(out)
+        } else {
+            deflate_unfinish(out).ok_or_else(|| {
+                std::io::Error::new(std::io::ErrorKind::InvalidData, "invalid deflate block")
+            })
+        }
+    }
+
+    fn encode_batch(&mut self, finish: bool) -> std::io::Result<()> {
+        if !self.header_written {
+            self.write.write_all(&GZIP_HEADER)?;
+            self.header_written = true;
+        }
+        if self.batch.is_empty() {
+            if finish {
+                self.write.write_all(&DEFLATE_EMPTY_FINAL)?;
+            }
+            return Ok(());
+        }
+        let zopfli = self.zopfli;
+        let dict_size = if zopfli { 0 } else { DEFLATE_WINDOW_SIZE };
+        let blocks = self
+            .batch
+            .encode_with_dict(&mut self.dict, dict_size, |dict, chunk, last| {
+                let last = finish && last;
+                let mut crc = Crc::new();
+                crc.update(chunk);
+                let block = if zopfli {
+                    Self::zopfli_block(chunk, last)
+                } else {
+                    Self::deflate_block(dict, chunk, last)
+                };
+                block.map(|b| (b, crc))
+            });
+        for block in blocks {
+            let (data, crc) = block?;
+            self.write.write_all(&data)?;
+            self.crc.combine(&crc);
+        }
+        Ok(())
+    }
+}
+
+impl<W: Write> Write for GzipBlockEncoder<W> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        self.write_all(buf)?;
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        Ok(())
+    }
+
+    fn write_all(&mut self, mut buf: &[u8]) -> std::io::Result<()> {
+        while !buf.is_empty() {
+            buf = self.batch.add_data(buf);
+            if self.batch.is_full() {
+                self.encode_batch(false)?;
+            }
+        }
+        Ok(())
+    }
+}
+
+impl<W: Write> WriteFinish<W> for GzipBlockEncoder<W> {
+    fn finish(mut self: Box<Self>) -> std::io::Result<W> {
+        self.encode_batch(true)?;
+        self.write.write_pod(&self.crc.sum())?;
+        self.write.write_pod(&self.crc.amount())?;
+        Ok(self.write)
+    }
+}
+
+// Parallel block decoding
+//
+// Multi-block XZ streams and LZ4 legacy archives consist of blocks that can be
+// decoded independently. The blocks are located with the XZ index or the LZ4
+// block headers, then decoded in windows of about one block per thread. The
+// blocks of a window are decoded concurrently, each directly into its own
+// region of a shared buffer, which is written out before the next window.
+//
+// Block sizes come from the input, so they are bounded before allocating
+// anything. Data with larger blocks is decoded as a stream instead.
+
+// Largest uncompressed block decoded in parallel
+const MAX_PAR_BLOCK: usize = 64 << 20;
+// Largest window of uncompressed data, unless a single block is larger
+const MAX_PAR_WINDOW: usize = 256 << 20;
+
+struct BlockJob<'a, T> {
+    input: &'a [u8],
+    // Format specific block information
+    meta: T,
+    out: &'a mut [u8],
+    // Number of bytes decoded into out
+    len: usize,
+    err: Option<std::io::Error>,
+}
+
+// Split out into one region for every (input, output size, meta) block
+fn split_jobs<'a, T>(
+    mut out: &'a mut [u8],
+    blocks: Vec<(&'a [u8], usize, T)>,
+) -> Vec<BlockJob<'a, T>> {
+    let mut jobs = Vec::with_capacity(blocks.len());
+    for (input, size, meta) in blocks {
+        let (region, rest) = out.split_at_mut(size);
+        out = rest;
+        jobs.push(BlockJob {
+            input,
+            meta,
+            out: region,
+            len: 0,
+            err: None,
+        });
+    }
+    jobs
+}
+
+fn decode_jobs<T: Send>(
+    jobs: &mut [BlockJob<T>],
+    f: impl Fn(&mut BlockJob<T>) -> std::io::Result<usize> + Sync,
+) -> std::io::Result<()> {
+    par_for_each_mut(jobs, |job| match f(job) {
+        Ok(len) => job.len = len,
+        Err(e) => job.err = Some(e),
+    });
+    // Report the error of the first failed block
+    match jobs.iter_mut().find_map(|job| job.err.take()) {
+        Some(e) => Err(e),
+        None => Ok(()),
+    }
+}
+
+// Decode the blocks window by window, and write the decoded data to out
+fn decode_windows<T: Send, W: Write + ?Sized>(
+    blocks: Vec<(&[u8], usize, T)>,
+    out: &mut W,
+    f: impl Fn(&mut BlockJob<T>) -> std::io::Result<usize> + Sync,
+) -> std::io::Result<()> {
+    let threads = thread_count();
+    let mut buf = Vec::new();
+    let mut blocks = blocks.into_iter().peekable();
+    while blocks.peek().is_some() {
+        let mut window = Vec::with_capacity(threads);
+        let mut size = 0;
+        while window.len() < threads
+            && let Some(block) =
+                blocks.next_if(|b| window.is_empty() || size + b.1 <= MAX_PAR_WINDOW)
+        {
+            size += block.1;
+            window.push(block);
+        }
+        if buf.len() < size {
+            buf.resize(size, 0);
+        }
+        let mut jobs = split_jobs(&mut buf[..size], window);
+        decode_jobs(&mut jobs, &f)?;
+        for job in &jobs {
+            out.write_all(&job.out[..job.len])?;
+        }
+    }
+    Ok(())
+}
+
+// All blocks of a single XZ stream, with their uncompressed and unpadded sizes
+fn xz_blocks(buf: &[u8]) -> Option<Vec<(&[u8], usize, u64)>> {
+    // Strip stream padding
+    let mut end = buf.len();
+    while end >= 4 && buf[end - 4..end] == [0; 4] {
+        end -= 4;
+    }
+    let buf = &buf[..end];
+    if buf.len() < 24 || !buf.starts_with(XZ_HEADER_MAGIC) || !buf.ends_with(XZ_FOOTER_MAGIC) {
+        return None;
+    }
+    let footer = &buf[buf.len() - 12..];
+    if footer[8..10] != buf[6..8] || crc32(&footer[4..10]).to_le_bytes() != footer[..4] {
+        return None;
+    }
+    let backward_size = u32::from_le_bytes([footer[4], footer[5], footer[6], footer[7]]);
+    let index_start = buf
+        .len()
+        .checked_sub(12 + (backward_size as usize + 1) * 4)
+        .filter(|start| *start >= 12 && backward_size != 0)?;
+    let (index, index_crc) = buf[index_start..buf.len() - 12].split_at(backward_size as usize * 4);
+    if index[0] != 0 || crc32(index).to_le_bytes() != index_crc {
+        return None;
+    }
+
+    let mut records = &index[1..];
+    let count = xz_read_varint(&mut records).ok()?;
+    let mut blocks = Vec::new();
+    let mut off = 12_usize;
+    for _ in 0..count {
+        let unpadded_size = xz_read_varint(&mut records).ok()?;
+        let uncompressed_size = usize::try_from(xz_read_varint(&mut records).ok()?).ok()?;
+        let padded_size = usize::try_from(unpadded_size)
+            .ok()?
+            .checked_next_multiple_of(4)?;
+        let block = buf.get(off..off.checked_add(padded_size)?)?;
+        blocks.push((block, uncompressed_size, unpadded_size));
+        off += padded_size;
+    }
+    // The index has to describe every byte before it
+    if off != index_start {
+        return None;
+    }
+    Some(blocks)
+}
+
+fn xz_decode_blocks<W: Write + ?Sized>(buf: &[u8], out: &mut W) -> Option<std::io::Result<()>> {
+    let blocks = xz_blocks(buf)?;
+    if blocks.len() < 2 || blocks.iter().any(|b| b.1 > MAX_PAR_BLOCK) {
+        return None;
+    }
+    let flags = [buf[6], buf[7]];
+
+    let res = decode_windows(blocks, out, |job| {
+        // Wrap the block in a single-block stream for the decoder
+        let mut header = Vec::with_capacity(12);
+        header.extend_from_slice(XZ_HEADER_MAGIC);
+        header.extend_from_slice(&flags);
+        header.extend_from_slice(&crc32(&flags).to_le_bytes());
+
+        let mut tail = vec![0_u8];
+        xz_write_varint(&mut tail, 1);
+        xz_write_varint(&mut tail, job.meta);
+        xz_write_varint(&mut tail, job.out.len() as u64);
+        tail.resize(tail.len().next_multiple_of(4), 0);
+        let index_crc = crc32(&tail);
+        tail.extend_from_slice(&index_crc.to_le_bytes());
+        let mut footer = [0_u8; 12];
+        let backward_size = (tail.len() / 4 - 1) as u32;
+        footer[4..8].copy_from_slice(&backward_size.to_le_bytes());
+        footer[8..10].copy_from_slice(&flags);
+        footer[10..12].copy_from_slice(XZ_FOOTER_MAGIC);
+        let footer_crc = crc32(&footer[4..10]);
+        footer[..4].copy_from_slice(&footer_crc.to_le_bytes());
+        tail.extend_from_slice(&footer);
+
+        let stream = Cursor::new(header)
+            .chain(job.input)
+            .chain(Cursor::new(tail));
+        let mut decoder = XzReader::new(stream, true);
+        decoder.read_exact(job.out)?;
+        // The block must not decode to more data than the index says
+        if decoder.read(&mut [0_u8; 1])? != 0 {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::InvalidData,
+                "xz block size mismatch",
+            ));
+        }
+        Ok(job.out.len())
+    });
+    Some(res)
+}
+
+// All blocks of a LZ4 legacy archive, following the same rules as LZ4BlockDecoder
+fn lz4_legacy_blocks(mut buf: &[u8]) -> Option<Vec<(&[u8], usize, ())>> {
+    let max_size = lz4::block::compress_bound(LZ4_BLOCK_SIZE).ok()?;
+    let mut blocks = Vec::new();
+    while let Some((size, rest)) = buf.split_first_chunk::<4>() {
+        let mut size = u32::from_le_bytes(*size);
+        buf = rest;
+        if size == LZ4_MAGIC {
+            let (next, rest) = buf.split_first_chunk::<4>()?;
+            size = u32::from_le_bytes(*next);
+            buf = rest;
+        }
+        let size = size as usize;
+        // Either the end of the data, or the LG format trailer
+        if size == 0 || size > max_size || buf.is_empty() {
+            break;
+        }
+        // Let the streaming decoder report truncated blocks
+        let (block, rest) = buf.split_at_checked(size)?;
+        blocks.push((block, LZ4_BLOCK_SIZE, ()));
+        buf = rest;
+    }
+    Some(blocks)
+}
+
+fn lz4_legacy_decode_blocks<W: Write + ?Sized>(
+    buf: &[u8],
+    out: &mut W,
+) -> Option<std::io::Result<()>> {
+    let blocks = lz4_legacy_blocks(buf)?;
+    if blocks.len() < 2 {
+        return None;
+    }
+
+    // Uncompressed block sizes are unknown, but never over LZ4_BLOCK_SIZE
+    let res = decode_windows(blocks, out, |job| {
+        lz4::block::decompress_to_buffer(job.input, Some(LZ4_BLOCK_SIZE as i32), job.out)
+    });
+    Some(res)
+}
+
+// Decode all blocks of the data in parallel into out. Returns None before
+// writing anything if the data does not consist of independent blocks, and
+// has to be decoded as a stream instead.
+fn par_decode<W: Write + ?Sized>(
+    format: FileFormat,
+    in_bytes: &[u8],
+    out: &mut W,
+) -> Option<std::io::Result<()>> {
+    if thread_count() <= 1 {
+        return None;
+    }
+    match format {
+        FileFormat::XZ => xz_decode_blocks(in_bytes, out),
+        FileFormat::LZ4_LEGACY | FileFormat::LZ4_LG => lz4_legacy_decode_blocks(in_bytes, out),
+        _ => None,
+    }
+}
+
+// Same level as the kernel uses for zstd compressed initramfs
+const ZSTD_CLEVEL: i32 = 19;
+
 // Top-level APIs
 
 pub fn get_encoder<'a, W: Write + 'a>(format: FileFormat, w: W) -> Box<dyn WriteFinish<W> + 'a> {
     match format {
         FileFormat::XZ => {
-            let mut opt = XzOptions::with_preset(9);
-            opt.set_check_sum_type(CheckType::Crc32);
-            Box::new(XzWriter::new(w, opt).unwrap())
+            let threads = encoder_threads();
+            if threads > 1 {
+                let block_size = block_size_or(XZ_BLOCK_SIZE);
+                Box::new(XzBlockEncoder::new(w, block_size, threads))
+            } else {
+                Box::new(XzWriter::new(w, xz_options(None)).unwrap())
+            }
         }
         FileFormat::LZMA => {
             Box::new(LzmaWriter::new_use_header(w, &LzmaOptions::with_preset(9), None).unwrap())
         }
         FileFormat::BZIP2 => Box::new(BzEncoder::new(w, BzCompression::best())),
         FileFormat::LZ4 => {
-            let encoder = LZ4FrameEncoderBuilder::new()
-                .block_size(BlockSize::Max4MB)
-                .block_mode(BlockMode::Independent)
-                .checksum(ContentChecksum::ChecksumEnabled)
-                .block_checksum(BlockChecksum::BlockChecksumEnabled)
-                .level(9)
-                .auto_flush(true)
-                .build(w)
-                .unwrap();
-            Box::new(encoder)
+            let threads = encoder_threads();
+            if threads > 1 {
+                Box::new(LZ4FrameBlockEncoder::new(w, threads))
+            } else {
+                let encoder = LZ4FrameEncoderBuilder::new()
+                    .block_size(BlockSize::Max4MB)
+                    .block_mode(BlockMode::Independent)
+                    .checksum(ContentChecksum::ChecksumEnabled)
+                    .block_checksum(BlockChecksum::BlockChecksumEnabled)
+                    .level(LZ4F_CLEVEL as u32)
+                    .auto_flush(true)
+                    .build(w)
+                    .unwrap();
+                Box::new(encoder)
+            }
         }
         FileFormat::LZ4_LEGACY => Box::new(LZ4BlockEncoder::new(w, false)),
         FileFormat::LZ4_LG => Box::new(LZ4BlockEncoder::new(w, true)),
-        FileFormat::ZOPFLI => {
-            // These options are already better than gzip -9
-            let opt = ZopfliOptions {
-                iteration_count: NonZeroU64::new(1).unwrap(),
-                maximum_block_splits: 1,
-                ..Default::default()
-            };
-            Box::new(ZopFliEncoder::new_buffered(opt, BlockType::Dynamic, w).unwrap())
+        FileFormat::ZOPFLI | FileFormat::GZIP => {
+            let zopfli = format == FileFormat::ZOPFLI;
+            let threads = encoder_threads();
+            if threads > 1 {
+                Box::new(GzipBlockEncoder::new(w, zopfli, threads))
+            } else if zopfli {
+                Box::new(
+                    ZopFliEncoder::new_buffered(zopfli_options(), BlockType::Dynamic, w).unwrap(),
+                )
+            } else {
+                Box::new(GzEncoder::new(w, GzCompression::best()))
+            }
+        }
+        FileFormat::ZSTD => {
+            let mut encoder = ZstdEncoder::new(w, level_or(ZSTD_CLEVEL)).unwrap();
+            encoder.include_checksum(true).unwrap();
+            let threads = encoder_threads();
+            if threads > 1 {
+                encoder.multithread(threads as u32).unwrap();
+                let block_size = block_size_or(0);
+                if block_size != 0 {
+                    encoder
+                        .set_parameter(ZstdParameter::JobSize(block_size as u32))
+                        .unwrap();
+                }
+            }
+            Box::new(encoder)
         }
-        FileFormat::GZIP => Box::new(GzEncoder::new(w, GzCompression::best())),
         _ => unreachable!(),
     }
 }
 
+// Largest dictionary of xz_encoder. The encoder needs about 10 times the
+// dictionary size in memory, and one runs on every worker thread.
+const XZ_WORKER_DICT_SIZE: usize = 8 << 20;
+
+// Single-threaded XZ encoder with a dictionary no larger than the input,
+// for data that is already compressed on worker threads
+pub(crate) fn xz_encoder<'a, W: Write + 'a>(w: W, size: usize) -> Box<dyn WriteFinish<W> + 'a> {
+    let size = min(size, XZ_WORKER_DICT_SIZE);
+    Box::new(XzWriter::new(w, xz_options(Some(size))).unwrap())
+}
+
 pub fn get_decoder<'a, R: Read + 'a>(format: FileFormat, r: R) -> Box<dyn Read + 'a> {
     match format {
         FileFormat::XZ => Box::new(XzReader::new(r, true)),
@@ -265,15 +1277,39 @@ pub fn get_decoder<'a, R: Read + 'a>(format: FileFormat, r: R) -> Box<dyn Read +
         FileFormat::LZ4 => Box::new(LZ4FrameDecoder::new(r).unwrap()),
         FileFormat::LZ4_LG | FileFormat::LZ4_LEGACY => Box::new(LZ4BlockDecoder::new(r)),
         FileFormat::ZOPFLI | FileFormat::GZIP => Box::new(MultiGzDecoder::new(r)),
+        FileFormat::ZSTD => Box::new(ZstdDecoder::new(r).unwrap()),
         _ => unreachable!(),
     }
 }
 
 // C++ FFI
 
+// Bump whenever the output of any encoder changes for the same settings,
+// so that existing cache entries are not served for the new output
+const ENCODER_VERSION: u32 = 3;
+
+// Every setting that affects the output of get_encoder
+fn encoder_settings(format: FileFormat) -> String {
+    format!(
+        "v{}-{}-l{}-j{}-b{}",
+        ENCODER_VERSION,
+        format,
+        LEVEL.load(Ordering::Relaxed),
+        encoder_threads(),
+        BLOCK_SIZE.load(Ordering::Relaxed)
+    )
+}
+
 pub fn compress_bytes(format: FileFormat, in_bytes: &[u8], out_fd: RawFd) {
     let mut out_file = unsafe { ManuallyDrop::new(File::from_raw_fd(out_fd)) };
 
+    if cache_enabled() {
+        let _: LoggedResult<()> = try {
+            out_file.write_all(&compress_vec(format, in_bytes)?)?;
+        };
+        return;
+    }
+
     let mut encoder = get_encoder(format, out_file.deref_mut());
     let _: LoggedResult<()> = try {
         encoder.write_all(in_bytes)?;
@@ -281,11 +1317,51 @@ pub fn compress_bytes(format: FileFormat, in_bytes: &[u8], out_fd: RawFd) {
     };
 }
 
+pub(crate) fn compress_vec(format: FileFormat, in_bytes: &[u8]) -> std::io::Result<Vec<u8>> {
+    cached(&encoder_settings(format), in_bytes, || {
+        let mut encoder = get_encoder(format, Vec::new());
+        encoder.write_all(in_bytes)?;
+        encoder.finish()
+    })
+}
+
+// Returns false if the encoder failed, out is then left untouched
+pub fn compress_to_vec(format: FileFormat, in_bytes: &[u8], out: &mut Vec<u8>) -> bool {
+    compress_vec(format, in_bytes)
+        .map(|v| *out = v)
+        .log()
+        .is_ok()
+}
+
+// Decompress all data to out, in parallel if the data is made of independent blocks
+pub(crate) fn decompress_to<W: Write + ?Sized>(
+    format: FileFormat,
+    in_bytes: &[u8],
+    out: &mut W,
+) -> std::io::Result<()> {
+    if let Some(res) = par_decode(format, in_bytes, out) {
+        return res;
+    }
+    let mut decoder = get_decoder(format, in_bytes);
+    std::io::copy(decoder.as_mut(), out)?;
+    Ok(())
+}
+
 pub fn decompress_bytes(format: FileFormat, in_bytes: &[u8], out_fd: RawFd) {
     let mut out_file = unsafe { ManuallyDrop::new(File::from_raw_fd(out_fd)) };
 
-    let mut decoder = get_decoder(format, in_bytes);
-    std::io::copy(decoder.as_mut(), out_file.deref_mut()).log_ok();
+    decompress_to(format, in_bytes, out_file.deref_mut()).log_ok();
+}
+
+// Same as decompress_bytes, but the error message is returned instead of logged,
+// so that concurrent jobs can report their errors in a fixed order
+pub fn decompress_bytes_quiet(format: FileFormat, in_bytes: &[u8], out_fd: RawFd) -> String {
+    let mut out_file = unsafe { ManuallyDrop::new(File::from_raw_fd(out_fd)) };
+
+    match decompress_to(format, in_bytes, out_file.deref_mut()) {
+        Ok(_) => String::new(),
+        Err(e) => e.to_string(),
+    }
 }
 
 // Command-line entry points
@@ -341,8 +1417,18 @@ pub(crate) fn decompress_cmd(infile: &Utf8CStr, outfile: Option<&Utf8CStr>) -> L
         FileOrStd::File(outfile.create(OFlag::O_WRONLY | OFlag::O_TRUNC, 0o644)?)
     };
 
-    let mut decoder = get_decoder(format, Cursor::new(buf).chain(input.as_file()));
-    std::io::copy(decoder.as_mut(), &mut output.as_file())?;
+    // Map the whole file if possible, so that independent blocks can be decoded in parallel
+    let map = if in_std {
+        None
+    } else {
+        MappedFile::open(infile).ok()
+    };
+    if let Some(map) = map {
+        decompress_to(format, map.as_ref(), &mut output.as_file())?;
+    } else {
+        let mut decoder = get_decoder(format, Cursor::new(buf).chain(input.as_file()));
+        std::io::copy(decoder.as_mut(), &mut output.as_file())?;
+    }
 
     if rm_in {
         infile.remove()?;
@@ -2,21 +2,30 @@
 
 use argh::FromArgs;
 use base::argh;
-use bytemuck::{Pod, Zeroable, from_bytes};
+use bytemuck::{Pod, Zeroable, bytes_of_mut, from_bytes};
 use num_traits::cast::AsPrimitive;
 use size::{Base, Size, Style};
-use std::cmp::Ordering;
+use std::borrow::Cow;
+use std::cmp::{Ordering, Reverse};
 use std::collections::{BTreeMap, HashMap};
+use std::env;
 use std::fmt::{Display, Formatter};
-use std::fs::File;
-use std::io::{Cursor, Read, Write};
+use std::fs::{self, File};
+use std::io::{BufRead, BufReader, Cursor, ErrorKind, IoSlice, Read, Write};
 use std::mem::size_of;
-use std::process::exit;
+use std::ops::Range;
+use std::os::fd::AsRawFd;
+use std::os::unix::fs::{MetadataExt, fchown};
+use std::path::PathBuf;
+use std::process;
 use std::str;
+use std::sync::atomic::{AtomicUsize, Ordering as AtomicOrdering};
 
 use crate::check_env;
-use crate::compress::{get_decoder, get_encoder};
-use crate::ffi::FileFormat;
+use crate::compress::{decompress_to, get_decoder, get_encoder, xz_encoder};
+use crate::ffi::{FileFormat, check_fmt};
+use crate::format::fmt_compressed;
+use crate::parallel::par_for_each_mut;
 use crate::patch::{patch_encryption, patch_verity};
 use base::libc::{
     S_IFBLK, S_IFCHR, S_IFDIR, S_IFLNK, S_IFMT, S_IFREG, S_IRGRP, S_IROTH, S_IRUSR, S_IWGRP,
@@ -25,10 +34,13 @@ use base::libc::{
 };
 use base::nix::fcntl::OFlag;
 use base::{
-    BytesExt, EarlyExitExt, LoggedResult, MappedFile, OptionExt, ResultExt, Utf8CStr, Utf8CStrBuf,
-    WriteExt, cstr, log_err,
+    BytesExt, LoggedResult, MappedFile, OptionExt, ReadExt, ResultExt, Utf8CStr, Utf8CStrBuf,
+    Utf8CStrBufArr, cstr, fd_get_secontext, fd_set_secontext, log_err,
 };
 
+// Make temporary file names unique among concurrent dumps
+static DUMP_SEQ: AtomicUsize = AtomicUsize::new(0);
+
 #[derive(FromArgs)]
 struct CpioCommand {
     #[argh(subcommand)]
@@ -149,6 +161,8 @@ pub(crate) fn print_cpio_usage() {
 
 Do cpio commands to <incpio> (modifications are done in-place).
 Each command is a single argument; add quotes for each command.
+If <incpio> is compressed, test, exists, ls and extract only decompress
+what they need, and modifications are recompressed in the same format.
 
 Supported commands:
   exists ENTRY
@@ -175,6 +189,9 @@ Supported commands:
     Configure with env variables: KEEPVERITY KEEPFORCEENCRYPT
   backup ORIG [-n]
     Create ramdisk backups from ORIG, specify [-n] to skip compression
+    Entries are compressed in parallel (see MAGISKBOOT_THREADS); entries
+    smaller than env variable MAGISKBOOT_BACKUP_XZ_MIN bytes are stored
+    uncompressed
   restore
     Restore ramdisk from ramdisk backup stored within incpio
 "#
@@ -200,27 +217,29 @@ struct CpioHeader {
     check: [u8; 8],
 }
 
-struct Cpio {
-    entries: BTreeMap<String, Box<CpioEntry>>,
+// Names and data of loaded entries borrow from the archive, usually a mapped
+// file, and are only copied when an entry is modified.
+struct Cpio<'a> {
+    entries: BTreeMap<Cow<'a, str>, Box<CpioEntry<'a>>>,
 }
 
-struct CpioEntry {
+struct CpioEntry<'a> {
     mode: mode_t,
     uid: uid_t,
     gid: gid_t,
     rdevmajor: dev_t,
     rdevminor: dev_t,
-    data: Vec<u8>,
+    data: Cow<'a, [u8]>,
 }
 
-impl Cpio {
+impl<'a> Cpio<'a> {
     fn new() -> Self {
         Self {
             entries: BTreeMap::new(),
         }
     }
 
-    fn load_from_data(data: &[u8]) -> LoggedResult<Self> {
+    fn load_from_data(data: &'a [u8]) -> LoggedResult<Self> {
         let mut cpio = Cpio::new();
         let mut pos = 0_usize;
         while pos < data.len() {
@@ -231,7 +250,7 @@ impl Cpio {
             }
             pos += hdr_sz;
             let name_sz = x8u(&hdr.namesize)? as usize;
-            let name = Utf8CStr::from_bytes(&data[pos..(pos + name_sz)])?.to_string();
+            let name = Utf8CStr::from_bytes(&data[pos..(pos + name_sz)])?.as_str();
             pos += name_sz;
             pos = align_4(pos);
             if name == "." || name == ".." {
@@ -251,67 +270,152 @@ impl Cpio {
                 gid: x8u(&hdr.gid)?.as_(),
                 rdevmajor: x8u(&hdr.rdevmajor)?.as_(),
                 rdevminor: x8u(&hdr.rdevminor)?.as_(),
-                data: data[pos..(pos + file_sz)].to_vec(),
+                data: Cow::Borrowed(&data[pos..(pos + file_sz)]),
             });
             pos += file_sz;
-            cpio.entries.insert(name, entry);
+            cpio.entries.insert(Cow::Borrowed(name), entry);
             pos = align_4(pos);
         }
         Ok(cpio)
     }
 
-    fn load_from_file(path: &Utf8CStr) -> LoggedResult<Self> {
-        eprintln!("Loading cpio: [{path}]");
-        let file = MappedFile::open(path)?;
-        Self::load_from_data(file.as_ref())
+    // Read an archive from a stream, only keeping the entries the scan needs,
+    // and stop reading as soon as the scan has its answer
+    fn load_from_reader<R: Read>(r: R, scan: &Scan) -> LoggedResult<Cpio<'static>> {
+        let mut r = BufReader::new(r);
+        let mut cpio = Cpio::new();
+        let mut pos = 0_usize;
+        let mut hdr = CpioHeader::zeroed();
+        let mut name_buf = Vec::new();
+        let mut after_trailer = false;
+        loop {
+            if after_trailer {
+                // Another archive may follow the padding
+                if !find_magic(&mut r, &mut pos)? {
+                    break;
+                }
+                after_trailer = false;
+            } else if r.fill_buf()?.is_empty() {
+                break;
+            } else {
+                r.read_exact(&mut hdr.magic)?;
+                pos += hdr.magic.len();
+                if &hdr.magic != b"070701" {
+                    return log_err!("invalid cpio magic");
+                }
+            }
+            r.read_exact(&mut bytes_of_mut(&mut hdr)[6..])?;
+            pos += size_of::<CpioHeader>() - 6;
+            let name_sz = x8u(&hdr.namesize)? as usize;
+            name_buf.resize(name_sz, 0);
+            r.read_exact(&mut name_buf)?;
+            pos += name_sz;
+            r.skip(align_4(pos) - pos)?;
+            pos = align_4(pos);
+            let name = Utf8CStr::from_bytes(&name_buf)?.as_str();
+            if name == "." || name == ".." {
+                continue;
+            }
+            if name == "TRAILER!!!" {
+                after_trailer = true;
+                continue;
+            }
+            let file_sz = x8u(&hdr.filesize)? as usize;
+            if scan.keeps(name) {
+                let mut data = vec![0; file_sz];
+                r.read_exact(&mut data)?;
+                let entry = Box::new(CpioEntry {
+                    mode: x8u(&hdr.mode)?.as_(),
+                    uid: x8u(&hdr.uid)?.as_(),
+                    gid: x8u(&hdr.gid)?.as_(),
+                    rdevmajor: x8u(&hdr.rdevmajor)?.as_(),
+                    rdevminor: x8u(&hdr.rdevminor)?.as_(),
+                    data: data.into(),
+                });
+                cpio.entries.insert(name.to_string().into(), entry);
+            } else {
+                r.skip(file_sz)?;
+            }
+            pos += file_sz;
+            r.skip(align_4(pos) - pos)?;
+            pos = align_4(pos);
+            if scan.done(&cpio) {
+                break;
+            }
+        }
+        Ok(cpio)
     }
 
-    fn dump(&self, path: &str) -> LoggedResult<()> {
+    // The archive is compressed on the fly if format is a compressed format
+    fn dump(&self, path: &str, format: FileFormat) -> LoggedResult<()> {
         eprintln!("Dumping cpio: [{path}]");
-        let mut file = File::create(path)?;
-        let mut pos = 0usize;
-        let mut inode = 300000i64;
+        // Entries may borrow from the mapped original file, so it cannot be
+        // truncated while dumping. Write a new file and replace it instead.
+        // Symlinks are resolved first, so that the link target is replaced.
+        let path = fs::canonicalize(path).unwrap_or_else(|_| PathBuf::from(path));
+        let mut tmp = path.clone().into_os_string();
+        let seq = DUMP_SEQ.fetch_add(1, AtomicOrdering::Relaxed);
+        tmp.push(format!(".{}.{}.tmp", process::id(), seq));
+        let res: LoggedResult<()> = try {
+            let mut file = File::options().write(true).create_new(true).open(&tmp)?;
+            if let Ok(old) = File::open(&path) {
+                let meta = old.metadata()?;
+                // Only root can give files away or relabel them, these are
+                // kept as they are otherwise
+                fchown(&file, Some(meta.uid()), Some(meta.gid())).ok();
+                file.set_permissions(meta.permissions())?;
+                let mut con = Utf8CStrBufArr::<128>::new();
+                if fd_get_secontext(old.as_raw_fd(), &mut con).is_ok() && !con.is_empty() {
+                    fd_set_secontext(file.as_raw_fd(), &con).ok();
+                }
+            }
+            if fmt_compressed(format) {
+                let mut encoder = get_encoder(format, file);
+                self.dump_to(encoder.as_mut())?;
+                encoder.finish()?;
+            } else {
+                self.dump_to(&mut file)?;
+            }
+            fs::rename(&tmp, &path)?;
+        };
+        if res.is_err() {
+            fs::remove_file(&tmp).ok();
+        }
+        res
+    }
+
+    fn dump_to<W: Write + ?Sized>(&self, out: &mut W) -> LoggedResult<()> {
+        let mut w = CpioWriter::new(out);
+        let mut inode = 300000_u32;
         for (name, entry) in &self.entries {
-            pos += file.write(
-                format!(
-                    "070701{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}",
-                    inode,
-                    entry.mode,
-                    entry.uid,
-                    entry.gid,
-                    1,
-                    0,
-                    entry.data.len(),
-                    0,
-                    0,
-                    entry.rdevmajor,
-                    entry.rdevminor,
-                    name.len() + 1,
-                    0
-                ).as_bytes(),
-            )?;
-            pos += file.write(name.as_bytes())?;
-            pos += file.write(&[0])?;
-            file.write_zeros(align_4(pos) - pos)?;
-            pos = align_4(pos);
-            pos += file.write(&entry.data)?;
-            file.write_zeros(align_4(pos) - pos)?;
-            pos = align_4(pos);
+            w.header(&[
+                inode,
+                entry.mode.as_(),
+                entry.uid.as_(),
+                entry.gid.as_(),
+                1,
+                0,
+                entry.data.len() as u32,
+                0,
+                0,
+                entry.rdevmajor.as_(),
+                entry.rdevminor.as_(),
+                name.len() as u32 + 1,
+                0,
+            ]);
+            w.name(name);
+            w.data(&entry.data)?;
             inode += 1;
         }
-        pos += file.write(
-            format!("070701{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}",
-                    inode, 0o755, 0, 0, 1, 0, 0, 0, 0, 0, 0, 11, 0
-            ).as_bytes()
-        )?;
-        pos += file.write("TRAILER!!!\0".as_bytes())?;
-        file.write_zeros(align_4(pos) - pos)?;
+        w.header(&[inode, 0o755, 0, 0, 1, 0, 0, 0, 0, 0, 0, 11, 0]);
+        w.name("TRAILER!!!");
+        w.finish()?;
         Ok(())
     }
 
     fn rm(&mut self, path: &str, recursive: bool) {
         let path = norm_path(path);
-        if self.entries.remove(&path).is_some() {
+        if self.entries.remove(path.as_str()).is_some() {
             eprintln!("Removed entry [{path}]");
         }
         if recursive {
@@ -357,7 +461,7 @@ impl Cpio {
             }
             S_IFLNK => {
                 buf.clear();
-                buf.push_str(str::from_utf8(entry.data.as_slice())?);
+                buf.push_str(str::from_utf8(&entry.data)?);
                 out.create_symlink_to(&buf)?;
             }
             S_IFBLK | S_IFCHR => {
@@ -380,14 +484,14 @@ impl Cpio {
                 if path == "." || path == ".." {
                     continue;
                 }
-                self.extract_entry(path, &mut path.clone())?;
+                self.extract_entry(path, &mut path.to_string())?;
             }
         }
         Ok(())
     }
 
     fn exists(&self, path: &str) -> bool {
-        self.entries.contains_key(&norm_path(path))
+        self.entries.contains_key(norm_path(path).as_str())
     }
 
     fn add(&mut self, mode: mode_t, path: &str, file: &mut String) -> LoggedResult<()> {
@@ -421,14 +525,14 @@ impl Cpio {
         };
 
         self.entries.insert(
-            norm_path(path),
+            norm_path(path).into(),
             Box::new(CpioEntry {
                 mode,
                 uid: 0,
                 gid: 0,
                 rdevmajor,
                 rdevminor,
-                data: content,
+                data: content.into(),
             }),
         );
         eprintln!("Add file [{path}] ({mode:04o})");
@@ -437,14 +541,14 @@ impl Cpio {
 
     fn mkdir(&mut self, mode: mode_t, dir: &str) {
         self.entries.insert(
-            norm_path(dir),
+            norm_path(dir).into(),
             Box::new(CpioEntry {
                 mode: mode | S_IFDIR,
                 uid: 0,
                 gid: 0,
                 rdevmajor: 0,
                 rdevminor: 0,
-                data: vec![],
+                data: Cow::Borrowed(&[]),
             }),
         );
         eprintln!("Create directory [{dir}] ({mode:04o})");
@@ -452,14 +556,14 @@ impl Cpio {
 
     fn ln(&mut self, src: &str, dst: &str) {
         self.entries.insert(
-            norm_path(dst),
+            norm_path(dst).into(),
             Box::new(CpioEntry {
                 mode: S_IFLNK,
                 uid: 0,
                 gid: 0,
                 rdevmajor: 0,
                 rdevminor: 0,
-                data: norm_path(src).as_bytes().to_vec(),
+                data: norm_path(src).into_bytes().into(),
             }),
         );
         eprintln!("Create symlink [{dst}] -> [{src}]");
@@ -468,9 +572,9 @@ impl Cpio {
     fn mv(&mut self, from: &str, to: &str) -> LoggedResult<()> {
         let entry = self
             .entries
-            .remove(&norm_path(from))
+            .remove(norm_path(from).as_str())
             .ok_or_log_msg(|w| w.write_fmt(format_args!("No such entry {from}")))?;
-        self.entries.insert(norm_path(to), entry);
+        self.entries.insert(norm_path(to).into(), entry);
         eprintln!("Move [{from}] -> [{to}]");
         Ok(())
     }
@@ -483,7 +587,7 @@ impl Cpio {
             "/".to_string() + path.as_str()
         };
         for (name, entry) in &self.entries {
-            let p = "/".to_string() + name.as_str();
+            let p = format!("/{name}");
             if !p.starts_with(&path) {
                 continue;
             }
@@ -502,7 +606,19 @@ impl Cpio {
 const MAGISK_PATCHED: i32 = 1 << 0;
 const UNSUPPORTED_CPIO: i32 = 1 << 1;
 
-impl Cpio {
+const UNSUPPORTED_FILES: [&str; 4] = [
+    "sbin/launch_daemonsu.sh",
+    "sbin/su",
+    "init.xposed.rc",
+    "boot/sbin/launch_daemonsu.sh",
+];
+const MAGISK_FILES: [&str; 3] = [
+    ".backup/.magisk",
+    "init.magisk.rc",
+    "overlay/init.magisk.rc",
+];
+
+impl<'a> Cpio<'a> {
     fn patch(&mut self) {
         let keep_verity = check_env("KEEPVERITY");
         let keep_force_encrypt = check_env("KEEPFORCEENCRYPT");
@@ -519,49 +635,35 @@ impl Cpio {
             if !keep_verity {
                 if fstab {
                     eprintln!("Found fstab file [{name}]");
-                    let len = patch_verity(entry.data.as_mut_slice());
-                    if len != entry.data.len() {
-                        entry.data.resize(len, 0);
-                    }
+                    // Only the patched entries are copied
+                    let data = entry.data.to_mut();
+                    let len = patch_verity(data);
+                    data.truncate(len);
                 } else if name == "verity_key" {
                     return false;
                 }
             }
             if !keep_force_encrypt && fstab {
-                let len = patch_encryption(entry.data.as_mut_slice());
-                if len != entry.data.len() {
-                    entry.data.resize(len, 0);
-                }
+                let data = entry.data.to_mut();
+                let len = patch_encryption(data);
+                data.truncate(len);
             }
             true
         });
     }
 
     fn test(&self) -> i32 {
-        for file in [
-            "sbin/launch_daemonsu.sh",
-            "sbin/su",
-            "init.xposed.rc",
-            "boot/sbin/launch_daemonsu.sh",
-        ] {
-            if self.exists(file) {
-                return UNSUPPORTED_CPIO;
-            }
+        if UNSUPPORTED_FILES.iter().any(|f| self.exists(f)) {
+            return UNSUPPORTED_CPIO;
         }
-        for file in [
-            ".backup/.magisk",
-            "init.magisk.rc",
-            "overlay/init.magisk.rc",
-        ] {
-            if self.exists(file) {
-                return MAGISK_PATCHED;
-            }
+        if MAGISK_FILES.iter().any(|f| self.exists(f)) {
+            return MAGISK_PATCHED;
         }
         0
     }
 
     fn restore(&mut self) -> LoggedResult<()> {
-        let mut backups = HashMap::<String, Box<CpioEntry>>::new();
+        let mut backups = HashMap::<Cow<str>, Box<CpioEntry>>::new();
         let mut rm_list = String::new();
         self.entries
             .extract_if(.., |name, _| name.starts_with(".backup/"))
@@ -577,7 +679,7 @@ impl Cpio {
                         &name[8..]
                     };
                     eprintln!("Restore [{name}] -> [{new_name}]");
-                    backups.insert(new_name.to_string(), entry);
+                    backups.insert(new_name.to_string().into(), entry);
                 }
             });
         self.rm(".backup", false);
@@ -595,36 +697,52 @@ impl Cpio {
         Ok(())
     }
 
-    fn backup(&mut self, origin: &mut String, skip_compress: bool) -> LoggedResult<()> {
-        let mut backups = HashMap::<String, Box<CpioEntry>>::new();
+    // If stock is provided, ORIG '-' refers to it instead of a file
+    fn backup(
+        &mut self,
+        origin: &mut String,
+        skip_compress: bool,
+        stock: Option<&[u8]>,
+    ) -> LoggedResult<()> {
+        let mut backups = HashMap::<Cow<str>, Box<CpioEntry>>::new();
         let mut rm_list = String::new();
         backups.insert(
-            ".backup".to_string(),
+            Cow::Borrowed(".backup"),
             Box::new(CpioEntry {
                 mode: S_IFDIR,
                 uid: 0,
                 gid: 0,
                 rdevmajor: 0,
                 rdevminor: 0,
-                data: vec![],
+                data: Cow::Borrowed(&[]),
             }),
         );
-        let origin = Utf8CStr::from_string(origin);
-        let mut o = Cpio::load_from_file(origin)?;
+        let map;
+        let mut buf = Vec::new();
+        let mut o = match stock {
+            Some(data) if origin == "-" => Cpio::load_from_data(data)?,
+            _ => {
+                map = map_cpio(Utf8CStr::from_string(origin))?;
+                Cpio::load_from_data(decompressed(map.as_ref(), &mut buf)?)?
+            }
+        };
         o.rm(".backup", true);
         self.rm(".backup", true);
 
+        // Entries to back up, and whether they are compressed
+        let mut pending = Vec::new();
+
         let mut lhs = o.entries.into_iter().peekable();
         let mut rhs = self.entries.iter().peekable();
 
         loop {
-            enum Action<'a> {
-                Backup(String, Box<CpioEntry>),
-                Record(&'a String),
+            enum Action<'o, 'n> {
+                Backup(Cow<'o, str>, Box<CpioEntry<'o>>),
+                Record(&'n str),
                 Noop,
             }
             let action = match (lhs.peek(), rhs.peek()) {
-                (Some((l, _)), Some((r, re))) => match l.as_str().cmp(r.as_str()) {
+                (Some((l, _)), Some((r, re))) => match str::cmp(l, r) {
                     Ordering::Less => {
                         let (l, le) = lhs.next().unwrap();
                         Action::Backup(l, le)
@@ -651,15 +769,7 @@ impl Cpio {
                 }
             };
             match action {
-                Action::Backup(name, mut entry) => {
-                    let backup = if !skip_compress && entry.compress() {
-                        format!(".backup/{name}.xz")
-                    } else {
-                        format!(".backup/{name}")
-                    };
-                    eprintln!("Backup [{name}] -> [{backup}]");
-                    backups.insert(backup, entry);
-                }
+                Action::Backup(name, entry) => pending.push((name, entry, false)),
                 Action::Record(name) => {
                     eprintln!("Record new entry: [{name}] -> [.backup/.rmlist]");
                     rm_list.push_str(&format!("{name}\0"));
@@ -667,16 +777,38 @@ impl Cpio {
                 Action::Noop => {}
             }
         }
+
+        if !skip_compress {
+            // Hand out the largest entries first to balance the workers
+            let min_size = backup_xz_min();
+            pending.sort_by_key(|(_, entry, _)| Reverse(entry.data.len()));
+            par_for_each_mut(&mut pending, |(_, entry, xz)| {
+                if entry.data.len() >= min_size {
+                    *xz = entry.compress();
+                }
+            });
+            pending.sort_by(|(a, ..), (b, ..)| a.cmp(b));
+        }
+        for (name, entry, xz) in pending {
+            let backup = if xz {
+                format!(".backup/{name}.xz")
+            } else {
+                format!(".backup/{name}")
+            };
+            eprintln!("Backup [{name}] -> [{backup}]");
+            // The original cpio is dropped at the end of this function
+            backups.insert(backup.into(), Box::new(entry.into_owned()));
+        }
         if !rm_list.is_empty() {
             backups.insert(
-                ".backup/.rmlist".to_string(),
+                Cow::Borrowed(".backup/.rmlist"),
                 Box::new(CpioEntry {
                     mode: S_IFREG,
                     uid: 0,
                     gid: 0,
                     rdevmajor: 0,
                     rdevminor: 0,
-                    data: rm_list.as_bytes().to_vec(),
+                    data: rm_list.into_bytes().into(),
                 }),
             );
         }
@@ -686,12 +818,20 @@ impl Cpio {
     }
 }
 
-impl CpioEntry {
+impl CpioEntry<'_> {
+    fn into_owned(self) -> CpioEntry<'static> {
+        CpioEntry {
+            data: Cow::Owned(self.data.into_owned()),
+            ..self
+        }
+    }
+
     pub(crate) fn compress(&mut self) -> bool {
         if self.mode & S_IFMT != S_IFREG {
             return false;
         }
-        let mut encoder = get_encoder(FileFormat::XZ, Vec::new());
+        // Entries are compressed on worker threads, one encoder each
+        let mut encoder = xz_encoder(Vec::new(), self.data.len());
         let Ok(data): std::io::Result<Vec<u8>> = (try {
             encoder.write_all(&self.data)?;
             encoder.finish()?
@@ -700,7 +840,7 @@ impl CpioEntry {
             return false;
         };
 
-        self.data = data;
+        self.data = data.into();
         true
     }
 
@@ -719,12 +859,12 @@ impl CpioEntry {
             return false;
         };
 
-        self.data = data;
+        self.data = data.into();
         true
     }
 }
 
-impl Display for CpioEntry {
+impl Display for CpioEntry<'_> {
     fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
         write!(
             f,
@@ -758,61 +898,379 @@ impl Display for CpioEntry {
     }
 }
 
-pub(crate) fn cpio_commands(file: &Utf8CStr, cmds: &Vec<String>) -> LoggedResult<()> {
-    let mut cpio = if file.exists() {
-        Cpio::load_from_file(file)?
+impl Cpio<'_> {
+    // Run the commands on the cpio. Returns None if it has to be saved, or the
+    // exit code of the command that ended processing.
+    fn run_commands(
+        &mut self,
+        cmds: &mut [CpioCommand],
+        stock: Option<&[u8]>,
+    ) -> LoggedResult<Option<i32>> {
+        for cmd in cmds {
+            match &mut cmd.action {
+                CpioAction::Test(_) => return Ok(Some(self.test())),
+                CpioAction::Restore(_) => self.restore()?,
+                CpioAction::Patch(_) => self.patch(),
+                CpioAction::Exists(Exists { path }) => {
+                    return if self.exists(path) {
+                        Ok(Some(0))
+                    } else {
+                        log_err!()
+                    };
+                }
+                CpioAction::Backup(Backup {
+                    origin,
+                    skip_compress,
+                }) => self.backup(origin, *skip_compress, stock)?,
+                CpioAction::Remove(Remove { path, recursive }) => self.rm(path, *recursive),
+                CpioAction::Move(Move { from, to }) => self.mv(from, to)?,
+                CpioAction::MakeDir(MakeDir { mode, dir }) => self.mkdir(*mode, dir),
+                CpioAction::Link(Link { src, dst }) => self.ln(src, dst),
+                CpioAction::Add(Add { mode, path, file }) => self.add(*mode, path, file)?,
+                CpioAction::Extract(Extract { paths }) => {
+                    if !paths.is_empty() && paths.len() != 2 {
+                        log_err!("invalid arguments")?;
+                    }
+                    let mut it = paths.iter_mut();
+                    self.extract(it.next(), it.next())?;
+                }
+                CpioAction::List(List { path, recursive }) => {
+                    self.ls(path.as_str(), *recursive);
+                    return Ok(Some(0));
+                }
+            };
+        }
+        Ok(None)
+    }
+}
+
+// Parse every command before running any of them, so that a typo never leaves
+// a half processed archive behind
+fn parse_commands(file: &str, cmds: &[String]) -> LoggedResult<Vec<CpioCommand>> {
+    cmds.iter()
+        .filter(|cmd| !cmd.starts_with('#'))
+        .map(|cmd| {
+            CpioCommand::from_args(
+                &["magiskboot", "cpio", file],
+                cmd.split(' ')
+                    .filter(|x| !x.is_empty())
+                    .collect::<Vec<_>>()
+                    .as_slice(),
+            )
+            .or_else(|e| {
+                if e.is_help {
+                    print_cpio_usage();
+                    return log_err!();
+                }
+                log_err!("{}", e.output.trim_end())
+            })
+        })
+        .collect()
+}
+
+// When a scan can stop reading a compressed archive
+#[derive(Default)]
+enum Stop {
+    #[default]
+    Never,
+    Found(String),
+    Unsupported,
+}
+
+// Entries needed by commands that don't modify the archive
+#[derive(Default)]
+struct Scan {
+    all: bool,
+    names: Vec<String>,
+    prefixes: Vec<String>,
+    stop: Stop,
+}
+
+impl Scan {
+    // None if the commands may modify the archive
+    fn new(cmds: &[CpioCommand]) -> Option<Scan> {
+        let mut scan = Scan::default();
+        let mut extract = false;
+        for cmd in cmds {
+            match &cmd.action {
+                CpioAction::Extract(Extract { paths }) => {
+                    match paths.first() {
+                        Some(path) => scan.names.push(norm_path(path)),
+                        None => scan.all = true,
+                    }
+                    extract = true;
+                }
+                // The commands below end processing. Reading can only stop
+                // early without extractions, as a later duplicate entry
+                // overrides an earlier one.
+                CpioAction::Test(_) => {
+                    let files = UNSUPPORTED_FILES.iter().chain(MAGISK_FILES.iter());
+                    scan.names.extend(files.map(|f| f.to_string()));
+                    if !extract {
+                        scan.stop = Stop::Unsupported;
+                    }
+                    return Some(scan);
+                }
+                CpioAction::Exists(Exists { path }) => {
+                    let path = norm_path(path);
+                    scan.names.push(path.clone());
+                    if !extract {
+                        scan.stop = Stop::Found(path);
+                    }
+                    return Some(scan);
+                }
+                CpioAction::List(List { path, .. }) => {
+                    scan.prefixes.push(norm_path(path));
+                    return Some(scan);
+                }
+                _ => return None,
+            }
+        }
+        Some(scan)
+    }
+
+    fn keeps(&self, name: &str) -> bool {
+        self.all
+            || self.names.iter().any(|n| n == name)
+            || self.prefixes.iter().any(|p| {
+                p.is_empty()
+                    || name
+                        .strip_prefix(p.as_str())
+                        .is_some_and(|s| s.is_empty() || s.starts_with('/'))
+            })
+    }
+
+    fn done(&self, cpio: &Cpio) -> bool {
+        match &self.stop {
+            Stop::Never => false,
+            Stop::Found(path) => cpio.entries.contains_key(path.as_str()),
+            Stop::Unsupported => UNSUPPORTED_FILES.iter().any(|f| cpio.exists(f)),
+        }
+    }
+}
+
+pub(crate) fn cpio_commands(file: &Utf8CStr, cmds: &Vec<String>) -> LoggedResult<i32> {
+    let mut cmds = parse_commands(file, cmds)?;
+    let map = if file.exists() {
+        Some(map_cpio(file)?)
+    } else {
+        None
+    };
+    let data = map.as_ref().map_or(&[][..], |m| m.as_ref());
+    let format = check_fmt(data);
+    let mut buf = Vec::new();
+    let data = if fmt_compressed(format) {
+        eprintln!("Ramdisk format: [{format}]");
+        // Read-only commands decompress only as much as they need
+        if let Some(scan) = Scan::new(&cmds) {
+            let mut cpio = Cpio::load_from_reader(get_decoder(format, data), &scan)?;
+            return Ok(cpio.run_commands(&mut cmds, None)?.unwrap_or(0));
+        }
+        decompress_to(format, data, &mut buf)?;
+        buf.as_slice()
     } else {
-        Cpio::new()
+        data
     };
+    let mut cpio = Cpio::load_from_data(data)?;
+    if let Some(code) = cpio.run_commands(&mut cmds, None)? {
+        return Ok(code);
+    }
+    // Recompressed in the original format
+    cpio.dump(file, format)?;
+    Ok(0)
+}
 
-    for cmd in cmds {
-        if cmd.starts_with('#') {
-            continue;
+// Run cpio commands on a ramdisk in memory, used by the patch command.
+// The patched cpio is stored uncompressed in out.
+pub fn patch_ramdisk(
+    format: FileFormat,
+    in_bytes: &[u8],
+    cmds: &Vec<String>,
+    out: &mut Vec<u8>,
+) -> bool {
+    let res: LoggedResult<()> = try {
+        let mut cmds = parse_commands("ramdisk.cpio", cmds)?;
+        // These end processing, which would silently skip the rest of the patch
+        if cmds.iter().any(|cmd| {
+            matches!(
+                cmd.action,
+                CpioAction::Test(_) | CpioAction::Exists(_) | CpioAction::List(_)
+            )
+        }) {
+            log_err!("test, exists and ls cannot be used with patch")?;
         }
-        let mut cmd = CpioCommand::from_args(
-            &["magiskboot", "cpio", file],
-            cmd.split(' ')
-                .filter(|x| !x.is_empty())
-                .collect::<Vec<_>>()
-                .as_slice(),
-        )
-        .on_early_exit(print_cpio_usage);
-
-        match &mut cmd.action {
-            CpioAction::Test(_) => exit(cpio.test()),
-            CpioAction::Restore(_) => cpio.restore()?,
-            CpioAction::Patch(_) => cpio.patch(),
-            CpioAction::Exists(Exists { path }) => {
-                return if cpio.exists(path) {
-                    Ok(())
-                } else {
-                    log_err!()
-                };
-            }
-            CpioAction::Backup(Backup {
-                origin,
-                skip_compress,
-            }) => cpio.backup(origin, *skip_compress)?,
-            CpioAction::Remove(Remove { path, recursive }) => cpio.rm(path, *recursive),
-            CpioAction::Move(Move { from, to }) => cpio.mv(from, to)?,
-            CpioAction::MakeDir(MakeDir { mode, dir }) => cpio.mkdir(*mode, dir),
-            CpioAction::Link(Link { src, dst }) => cpio.ln(src, dst),
-            CpioAction::Add(Add { mode, path, file }) => cpio.add(*mode, path, file)?,
-            CpioAction::Extract(Extract { paths }) => {
-                if !paths.is_empty() && paths.len() != 2 {
-                    log_err!("invalid arguments")?;
-                }
-                let mut it = paths.iter_mut();
-                cpio.extract(it.next(), it.next())?;
+        let mut data = Vec::new();
+        let stock = if fmt_compressed(format) {
+            decompress_to(format, in_bytes, &mut data)?;
+            data.as_slice()
+        } else {
+            in_bytes
+        };
+        let mut cpio = if stock.is_empty() {
+            Cpio::new()
+        } else {
+            Cpio::load_from_data(stock)?
+        };
+        cpio.run_commands(&mut cmds, Some(stock))?;
+        cpio.dump_to(out)?;
+    };
+    res.log_with_msg(|w| w.write_str("Failed to patch ramdisk"))
+        .is_ok()
+}
+
+// Serializes newc entries with gathered writes. Headers, names, padding and
+// small files are packed into a reused buffer, larger files are written
+// straight from the entries.
+struct CpioWriter<'a, 'w, W: Write + ?Sized> {
+    out: &'w mut W,
+    // Bytes serialized so far, for alignment
+    pos: usize,
+    buf: Vec<u8>,
+    segments: Vec<Segment<'a>>,
+}
+
+enum Segment<'a> {
+    Buf(Range<usize>),
+    Data(&'a [u8]),
+}
+
+const CPIO_HDR_SIZE: usize = 110;
+// Files smaller than this are copied into the buffer
+const INLINE_DATA: usize = 4096;
+// Pending writes are flushed past either limit, the first is below IOV_MAX
+const MAX_SEGMENTS: usize = 1024;
+const MAX_BUF: usize = 1 << 20;
+
+impl<'a, 'w, W: Write + ?Sized> CpioWriter<'a, 'w, W> {
+    fn new(out: &'w mut W) -> Self {
+        CpioWriter {
+            out,
+            pos: 0,
+            buf: Vec::with_capacity(MAX_BUF + INLINE_DATA),
+            segments: Vec::with_capacity(MAX_SEGMENTS),
+        }
+    }
+
+    fn push(&mut self, bytes: &[u8]) {
+        if bytes.is_empty() {
+            return;
+        }
+        let start = self.buf.len();
+        self.buf.extend_from_slice(bytes);
+        match self.segments.last_mut() {
+            Some(Segment::Buf(r)) => r.end = self.buf.len(),
+            _ => self.segments.push(Segment::Buf(start..self.buf.len())),
+        }
+        self.pos += bytes.len();
+    }
+
+    fn pad(&mut self) {
+        let n = align_4(self.pos) - self.pos;
+        self.push(&[0; 4][..n]);
+    }
+
+    fn header(&mut self, fields: &[u32; 13]) {
+        const HEX: &[u8; 16] = b"0123456789abcdef";
+        let mut hdr = [0_u8; CPIO_HDR_SIZE];
+        hdr[..6].copy_from_slice(b"070701");
+        for (field, v) in hdr[6..].chunks_exact_mut(8).zip(fields) {
+            for (i, b) in field.iter_mut().enumerate() {
+                *b = HEX[(v >> (28 - i * 4) & 0xf) as usize];
             }
-            CpioAction::List(List { path, recursive }) => {
-                cpio.ls(path.as_str(), *recursive);
-                return Ok(());
+        }
+        self.push(&hdr);
+    }
+
+    fn name(&mut self, name: &str) {
+        self.push(name.as_bytes());
+        self.push(&[0]);
+        self.pad();
+    }
+
+    fn data(&mut self, data: &'a [u8]) -> std::io::Result<()> {
+        if data.len() < INLINE_DATA {
+            self.push(data);
+        } else {
+            self.segments.push(Segment::Data(data));
+            self.pos += data.len();
+        }
+        self.pad();
+        if self.segments.len() >= MAX_SEGMENTS || self.buf.len() >= MAX_BUF {
+            self.flush()?;
+        }
+        Ok(())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        let mut slices: Vec<IoSlice> = self
+            .segments
+            .iter()
+            .map(|s| match s {
+                Segment::Buf(r) => IoSlice::new(&self.buf[r.clone()]),
+                Segment::Data(d) => IoSlice::new(d),
+            })
+            .collect();
+        let mut bufs = slices.as_mut_slice();
+        while !bufs.is_empty() {
+            match self.out.write_vectored(bufs) {
+                Ok(0) => return Err(ErrorKind::WriteZero.into()),
+                Ok(n) => IoSlice::advance_slices(&mut bufs, n),
+                Err(e) if e.kind() == ErrorKind::Interrupted => {}
+                Err(e) => return Err(e),
             }
-        };
+        }
+        self.segments.clear();
+        self.buf.clear();
+        Ok(())
     }
-    cpio.dump(file)?;
-    Ok(())
+
+    fn finish(mut self) -> std::io::Result<()> {
+        self.flush()?;
+        self.out.flush()
+    }
+}
+
+// Backup entries smaller than this are stored uncompressed
+fn backup_xz_min() -> usize {
+    env::var("MAGISKBOOT_BACKUP_XZ_MIN")
+        .ok()
+        .and_then(|s| s.parse::<usize>().ok())
+        .unwrap_or(0)
+}
+
+// The raw archive in data, decompressed into buf if needed
+fn decompressed<'a>(data: &'a [u8], buf: &'a mut Vec<u8>) -> LoggedResult<&'a [u8]> {
+    let format = check_fmt(data);
+    if fmt_compressed(format) {
+        decompress_to(format, data, buf)?;
+        Ok(buf)
+    } else {
+        Ok(data)
+    }
+}
+
+// Consume the stream up to and including the next cpio magic, returns false
+// if the stream ends first
+fn find_magic<R: Read>(r: &mut R, pos: &mut usize) -> std::io::Result<bool> {
+    let mut window = [0_u8; 6];
+    let mut byte = [0_u8];
+    let mut n = 0;
+    while r.read(&mut byte)? == 1 {
+        *pos += 1;
+        window.copy_within(1.., 0);
+        window[5] = byte[0];
+        n += 1;
+        if n >= window.len() && &window == b"070701" {
+            return Ok(true);
+        }
+    }
+    Ok(false)
+}
+
+// Loaded cpio entries borrow from the returned mapping
+fn map_cpio(path: &Utf8CStr) -> LoggedResult<MappedFile> {
+    eprintln!("Loading cpio: [{path}]");
+    Ok(MappedFile::open(path)?)
 }
 
 fn x8u(x: &[u8; 8]) -> LoggedResult<u32> {
@@ -0,0 +1,220 @@
+// Minimal raw deflate stream walker, used to join independently compressed
+// deflate segments into a single stream. Nothing is decompressed, the
+// symbols are only decoded to locate the block boundaries.
+
+const MAX_BITS: usize = 15;
+
+// Order of the code length code lengths
+const CLEN_ORDER: [usize; 19] = [
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+];
+
+// Extra bits of length codes 257..285
+const LEN_EXTRA: [u8; 29] = [
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+];
+
+// Extra bits of distance codes 0..29
+const DIST_EXTRA: [u8; 30] = [
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13,
+    13,
+];
+
+// An empty non-final stored block, after the 3 header bits and the padding
+const SYNC_MARKER: [u8; 4] = [0x00, 0x00, 0xff, 0xff];
+
+struct BitReader<'a> {
+    data: &'a [u8],
+    // Position in bits
+    pos: usize,
+}
+
+impl BitReader<'_> {
+    fn bits(&mut self, n: usize) -> Option<u32> {
+        if self.pos + n > self.data.len() * 8 {
+            return None;
+        }
+        let mut val = 0_u32;
+        for i in 0..n {
+            let bit = (self.data[(self.pos + i) / 8] >> ((self.pos + i) % 8)) & 1;
+            val |= (bit as u32) << i;
+        }
+        self.pos += n;
+        Some(val)
+    }
+
+    fn align(&mut self) {
+        self.pos = self.pos.next_multiple_of(8);
+    }
+}
+
+// Canonical Huffman code
+struct Huffman {
+    counts: [u16; MAX_BITS + 1],
+    symbols: Vec<u16>,
+}
+
+impl Huffman {
+    fn new(lengths: &[u8]) -> Option<Self> {
+        let mut counts = [0_u16; MAX_BITS + 1];
+        for len in lengths {
+            counts[*len as usize] += 1;
+        }
+        counts[0] = 0;
+
+        // Reject over-subscribed codes
+        let mut left = 1_i32;
+        for count in &counts[1..] {
+            left = (left << 1) - *count as i32;
+            if left < 0 {
+                return None;
+            }
+        }
+
+        let mut offsets = [0_u16; MAX_BITS + 2];
+        for len in 1..=MAX_BITS {
+            offsets[len + 1] = offsets[len] + counts[len];
+        }
+        let mut symbols = vec![0_u16; offsets[MAX_BITS + 1] as usize];
+        for (sym, len) in lengths.iter().enumerate() {
+            if *len != 0 {
+                symbols[offsets[*len as usize] as usize] = sym as u16;
+                offsets[*len as usize] += 1;
+            }
+        }
+        Some(Huffman { counts, symbols })
+    }
+
+    fn decode(&self, r: &mut BitReader) -> Option<u16> {
+        let mut code = 0_i32;
+        let mut first = 0_i32;
+        let mut index = 0_i32;
+        for len in 1..=MAX_BITS {
+            code |= r.bits(1)? as i32;
+            let count = self.counts[len] as i32;
+            if code - first < count {
+                return self.symbols.get((index + code - first) as usize).copied();
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+        None
+    }
+}
+
+fn fixed_codes() -> Option<(Huffman, Huffman)> {
+    let mut lengths = [0_u8; 288];
+    lengths[..144].fill(8);
+    lengths[144..256].fill(9);
+    lengths[256..280].fill(7);
+    lengths[280..].fill(8);
+    Some((Huffman::new(&lengths)?, Huffman::new(&[5; 30])?))
+}
+
+fn dynamic_codes(r: &mut BitReader) -> Option<(Huffman, Huffman)> {
+    let nlen = r.bits(5)? as usize + 257;
+    let ndist = r.bits(5)? as usize + 1;
+    let ncode = r.bits(4)? as usize + 4;
+    if nlen > 286 || ndist > 30 {
+        return None;
+    }
+
+    let mut clens = [0_u8; 19];
+    for i in CLEN_ORDER.iter().take(ncode) {
+        clens[*i] = r.bits(3)? as u8;
+    }
+    let clen_code = Huffman::new(&clens)?;
+
+    let mut lengths = vec![0_u8; nlen + ndist];
+    let mut i = 0;
+    while i < lengths.len() {
+        let sym = clen_code.decode(r)?;
+        let (val, repeat) = match sym {
+            0..=15 => (sym as u8, 1),
+            16 => (*lengths.get(i.checked_sub(1)?)?, 3 + r.bits(2)? as usize),
+            17 => (0, 3 + r.bits(3)? as usize),
+            18 => (0, 11 + r.bits(7)? as usize),
+            _ => return None,
+        };
+        if i + repeat > lengths.len() {
+            return None;
+        }
+        lengths[i..i + repeat].fill(val);
+        i += repeat;
+    }
+    Some((
+        Huffman::new(&lengths[..nlen])?,
+        Huffman::new(&lengths[nlen..])?,
+    ))
+}
+
+fn skip_codes(r: &mut BitReader, lit: &Huffman, dist: &Huffman) -> Option<()> {
+    loop {
+        let sym = lit.decode(r)? as usize;
+        if sym < 256 {
+            continue;
+        }
+        if sym == 256 {
+            return Some(());
+        }
+        r.bits(*LEN_EXTRA.get(sym - 257)? as usize)?;
+        let dsym = dist.decode(r)? as usize;
+        r.bits(*DIST_EXTRA.get(dsym)? as usize)?;
+    }
+}
+
+// Walk all blocks of a raw deflate stream. Return the bit offsets of
+// the final block header and the end of the stream.
+fn find_final_block(data: &[u8]) -> Option<(usize, usize)> {
+    let mut r = BitReader { data, pos: 0 };
+    loop {
+        let header = r.pos;
+        let is_final = r.bits(1)? == 1;
+        match r.bits(2)? {
+            0 => {
+                r.align();
+                let len = r.bits(16)?;
+                let nlen = r.bits(16)?;
+                if len != !nlen & 0xffff {
+                    return None;
+                }
+                r.pos += len as usize * 8;
+                if r.pos > data.len() * 8 {
+                    return None;
+                }
+            }
+            1 => {
+                let (lit, dist) = fixed_codes()?;
+                skip_codes(&mut r, &lit, &dist)?;
+            }
+            2 => {
+                let (lit, dist) = dynamic_codes(&mut r)?;
+                skip_codes(&mut r, &lit, &dist)?;
+            }
+            _ => return None,
+        }
+        if is_final {
+            return Some((header, r.pos));
+        }
+    }
+}
+
+// Turn a complete raw deflate stream into one that can be followed by more
+// deflate blocks: clear the final bit of its last block, then terminate it
+// with an empty stored block so that it ends on a byte boundary.
+pub fn deflate_unfinish(mut data: Vec<u8>) -> Option<Vec<u8>> {
+    let (header, end) = find_final_block(&data)?;
+    data[header / 8] &= !(1 << (header % 8));
+
+    // The 3 header bits of the stored block are all zeros
+    let len = end / 8;
+    let bits = end % 8;
+    if bits != 0 {
+        data[len] &= (1 << bits) - 1;
+    }
+    data.truncate((end + 3).div_ceil(8));
+    data.resize((end + 3).div_ceil(8), 0);
+    data.extend_from_slice(&SYNC_MARKER);
+    Some(data)
+}
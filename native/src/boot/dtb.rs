@@ -5,6 +5,7 @@ use fdt::{Fdt, FdtError};
 use std::cell::UnsafeCell;
 
 use crate::check_env;
+use crate::parallel::par_map;
 use crate::patch::patch_verity;
 
 #[derive(FromArgs)]
@@ -46,7 +47,10 @@ Supported actions:
   test
     Test the fstab's status
     Return values:
-    0:valid    1:error"#
+    0:valid    1:error
+
+patch and test process the dtbs of <file> on multiple threads
+(see MAGISKBOOT_THREADS in repack)"#
     );
 }
 
@@ -136,53 +140,70 @@ fn print_node(node: &FdtNode) {
     do_print_node(node, &mut vec![]);
 }
 
-fn for_each_fdt<F: FnMut(usize, Fdt) -> LoggedResult<()>>(
-    file: &Utf8CStr,
-    rw: bool,
-    mut f: F,
-) -> LoggedResult<()> {
-    eprintln!("Loading dtbs from [{file}]");
-    let file = if rw {
-        MappedFile::open_rw(file)?
-    } else {
-        MappedFile::open(file)?
-    };
-    let mut buf = Some(file.as_ref());
-    let mut dtb_num = 0usize;
-    while let Some(slice) = buf {
-        let slice = if let Some(pos) = slice.windows(4).position(|w| w == b"\xd0\x0d\xfe\xed") {
-            &slice[pos..]
-        } else {
-            break;
-        };
+// Locate every FDT in a dtb or dtbo blob, each slice spans exactly one FDT
+fn split_fdts(mut buf: &[u8]) -> LoggedResult<Vec<&[u8]>> {
+    let mut fdts = Vec::new();
+    while let Some(pos) = buf.windows(4).position(|w| w == b"\xd0\x0d\xfe\xed") {
+        let slice = &buf[pos..];
         if slice.len() < 40 {
             break;
         }
         let fdt = match Fdt::new(slice) {
             Err(FdtError::BufferTooSmall) => {
-                eprintln!("dtb.{dtb_num:04} is truncated");
+                eprintln!("dtb.{:04} is truncated", fdts.len());
                 break;
             }
             Ok(fdt) => fdt,
             e => e?,
         };
-
         let size = fdt.total_size();
+        fdts.push(&slice[..size]);
+        buf = &slice[size..];
+    }
+    Ok(fdts)
+}
 
-        f(dtb_num, fdt)?;
+fn map_dtb(file: &Utf8CStr, rw: bool) -> LoggedResult<MappedFile> {
+    eprintln!("Loading dtbs from [{file}]");
+    Ok(if rw {
+        MappedFile::open_rw(file)?
+    } else {
+        MappedFile::open(file)?
+    })
+}
 
-        dtb_num += 1;
-        buf = Some(&slice[size..]);
+fn for_each_fdt<F: FnMut(usize, Fdt) -> LoggedResult<()>>(
+    file: &Utf8CStr,
+    mut f: F,
+) -> LoggedResult<()> {
+    let file = map_dtb(file, false)?;
+    for (n, slice) in split_fdts(file.as_ref())?.into_iter().enumerate() {
+        f(n, Fdt::new(slice)?)?;
     }
     Ok(())
 }
 
+// FDTs are independent of each other and never change size when patched,
+// so they are processed in place on worker threads. The results are
+// returned in the order of the FDTs in the file.
+fn par_map_fdt<R, F>(file: &Utf8CStr, rw: bool, f: F) -> LoggedResult<Vec<R>>
+where
+    R: Send,
+    F: Fn(Fdt) -> LoggedResult<R> + Sync,
+{
+    let file = map_dtb(file, rw)?;
+    let fdts = split_fdts(file.as_ref())?;
+    par_map(&fdts, |slice| -> LoggedResult<R> { f(Fdt::new(slice)?) })
+        .into_iter()
+        .collect()
+}
+
 fn find_fstab<'b, 'a: 'b>(fdt: &'b Fdt<'a>) -> Option<FdtNode<'b, 'a>> {
     fdt.all_nodes().find(|node| node.name == "fstab")
 }
 
 fn dtb_print(file: &Utf8CStr, fstab: bool) -> LoggedResult<()> {
-    for_each_fdt(file, false, |n, fdt| {
+    for_each_fdt(file, |n, fdt| {
         if fstab {
             if let Some(fstab) = find_fstab(&fdt) {
                 eprintln!("Found fstab in dtb.{n:04}");
@@ -200,8 +221,7 @@ fn dtb_print(file: &Utf8CStr, fstab: bool) -> LoggedResult<()> {
 }
 
 fn dtb_test(file: &Utf8CStr) -> LoggedResult<bool> {
-    let mut ret = true;
-    for_each_fdt(file, false, |_, fdt| {
+    let results = par_map_fdt(file, false, |fdt| {
         if let Some(fstab) = find_fstab(&fdt) {
             for child in fstab.children() {
                 if child.name != "system" {
@@ -210,54 +230,59 @@ fn dtb_test(file: &Utf8CStr) -> LoggedResult<bool> {
                 if let Some(mount_point) = child.property("mnt_point")
                     && mount_point.value == b"/system_root\0"
                 {
-                    ret = false;
-                    break;
+                    return Ok(false);
                 }
             }
         }
-        Ok(())
+        Ok(true)
     })?;
-    Ok(ret)
+    Ok(results.into_iter().all(|valid| valid))
 }
 
-fn dtb_patch(file: &Utf8CStr) -> LoggedResult<bool> {
-    let keep_verity = check_env("KEEPVERITY");
-    let mut patched = false;
-    for_each_fdt(file, true, |n, fdt| {
-        for node in fdt.all_nodes() {
-            if node.name != "chosen" {
-                continue;
-            }
-            if let Some(boot_args) = node.property("bootargs") {
-                boot_args.value.windows(14).for_each(|w| {
-                    if w == b"skip_initramfs" {
-                        let w = unsafe {
-                            &mut *std::mem::transmute::<&[u8], &UnsafeCell<[u8]>>(w).get()
-                        };
-                        w[..=4].copy_from_slice(b"want");
-                        eprintln!("Patch [skip_initramfs] -> [want_initramfs] in dtb.{n:04}");
-                        patched = true;
-                    }
-                });
-            }
+// Returns the number of skip_initramfs patched, and whether verity was removed
+fn patch_fdt(fdt: Fdt, keep_verity: bool) -> (usize, bool) {
+    let mut initramfs = 0;
+    for node in fdt.all_nodes() {
+        if node.name != "chosen" {
+            continue;
         }
-        if keep_verity {
-            return Ok(());
+        if let Some(boot_args) = node.property("bootargs") {
+            boot_args.value.windows(14).for_each(|w| {
+                if w == b"skip_initramfs" {
+                    let w =
+                        unsafe { &mut *std::mem::transmute::<&[u8], &UnsafeCell<[u8]>>(w).get() };
+                    w[..=4].copy_from_slice(b"want");
+                    initramfs += 1;
+                }
+            });
         }
-        if let Some(fstab) = find_fstab(&fdt) {
-            for child in fstab.children() {
-                if let Some(flags) = child.property("fsmgr_flags") {
-                    let flags = unsafe {
-                        &mut *std::mem::transmute::<&[u8], &UnsafeCell<[u8]>>(flags.value).get()
-                    };
-                    if patch_verity(flags) != flags.len() {
-                        patched = true;
-                    }
+    }
+    let mut verity = false;
+    if !keep_verity && let Some(fstab) = find_fstab(&fdt) {
+        for child in fstab.children() {
+            if let Some(flags) = child.property("fsmgr_flags") {
+                let flags = unsafe {
+                    &mut *std::mem::transmute::<&[u8], &UnsafeCell<[u8]>>(flags.value).get()
+                };
+                if patch_verity(flags) != flags.len() {
+                    verity = true;
                 }
             }
         }
-        Ok(())
-    })?;
+    }
+    (initramfs, verity)
+}
+
+fn dtb_patch(file: &Utf8CStr) -> LoggedResult<bool> {
+    let keep_verity = check_env("KEEPVERITY");
+    let results = par_map_fdt(file, true, |fdt| Ok(patch_fdt(fdt, keep_verity)))?;
+    let mut patched = false;
+    for (n, (initramfs, verity)) in results.into_iter().enumerate() {
+        for _ in 0..initramfs {
+            eprintln!("Patch [skip_initramfs] -> [want_initramfs] in dtb.{n:04}");
+        }
+        patched |= initramfs > 0 || verity;
+    }
     Ok(patched)
 }
 
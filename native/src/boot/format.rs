@@ -16,6 +16,7 @@ impl FromStr for FileFormat {
             "lz4" => Ok(Self::LZ4),
             "lz4_legacy" => Ok(Self::LZ4_LEGACY),
             "lz4_lg" => Ok(Self::LZ4_LG),
+            "zstd" => Ok(Self::ZSTD),
             _ => Err(()),
         }
     }
@@ -39,6 +40,7 @@ impl FileFormat {
             Self::LZ4 => cstr!("lz4"),
             Self::LZ4_LEGACY => cstr!("lz4_legacy"),
             Self::LZ4_LG => cstr!("lz4_lg"),
+            Self::ZSTD => cstr!("zstd"),
             Self::DTB => cstr!("dtb"),
             Self::ZIMAGE => cstr!("zimage"),
             _ => cstr!("raw"),
@@ -55,6 +57,7 @@ impl FileFormat {
             Self::LZMA => "lzma",
             Self::BZIP2 => "bz2",
             Self::LZ4 | Self::LZ4_LEGACY | Self::LZ4_LG => "lz4",
+            Self::ZSTD => "zst",
             _ => "",
         }
     }
@@ -70,10 +73,16 @@ impl FileFormat {
                 | Self::LZ4
                 | Self::LZ4_LEGACY
                 | Self::LZ4_LG
+                | Self::ZSTD
         )
     }
 
     pub fn formats() -> String {
+        Self::formats_with(|_| true)
+    }
+
+    // Names of the supported compression formats that match the filter
+    pub fn formats_with(filter: impl Fn(FileFormat) -> bool) -> String {
         [
             Self::GZIP,
             Self::ZOPFLI,
@@ -83,8 +92,12 @@ impl FileFormat {
             Self::LZ4,
             Self::LZ4_LEGACY,
             Self::LZ4_LG,
+            Self::ZSTD,
         ]
+        .into_iter()
+        .filter(|f| filter(*f))
         .map(|f| f.to_string())
+        .collect::<Vec<_>>()
         .join(" ")
     }
 }
@@ -4,22 +4,31 @@
 #![feature(try_blocks)]
 
 pub use base;
-use compress::{compress_bytes, decompress_bytes};
+use autofmt::{compress_ramdisk_auto, ramdisk_auto_enabled};
+use compress::{compress_bytes, compress_to_vec, decompress_bytes, decompress_bytes_quiet};
+use cpio::patch_ramdisk;
 use format::{fmt_compressed, fmt_compressed_any, fmt2name};
+use parallel::{set_worker_threads, thread_count};
 use sign::{SHA, get_sha, sha256_hash, sign_payload_for_cxx};
 use std::env;
 
+mod autofmt;
+mod batch;
+mod cache;
 mod cli;
 mod compress;
 mod cpio;
+mod deflate;
 mod dtb;
 mod format;
+mod parallel;
 mod patch;
 mod payload;
 // Suppress warnings in generated code
 #[allow(warnings)]
 mod proto;
 mod sign;
+mod verity;
 
 #[cxx::bridge]
 pub mod ffi {
@@ -40,6 +49,7 @@ pub mod ffi {
         LZ4,
         LZ4_LEGACY,
         LZ4_LG,
+        ZSTD,
         /* Unsupported compression */
         LZOP,
         /* Misc */
@@ -56,7 +66,8 @@ pub mod ffi {
 
         fn cleanup();
         fn unpack(image: Utf8CStrRef, skip_decomp: bool, hdr: bool) -> i32;
-        fn repack(src_img: Utf8CStrRef, out_img: Utf8CStrRef, skip_comp: bool);
+        fn repack(src_img: Utf8CStrRef, out_img: Utf8CStrRef, skip_comp: bool) -> bool;
+        fn patch_image(src_img: Utf8CStrRef, out_img: Utf8CStrRef, cmds: &Vec<String>) -> i32;
         fn split_image_dtb(filename: Utf8CStrRef, skip_decomp: bool) -> i32;
         fn check_fmt(buf: &[u8]) -> FileFormat;
     }
@@ -70,10 +81,26 @@ pub mod ffi {
         fn sha256_hash(data: &[u8], out: &mut [u8]);
 
         fn compress_bytes(format: FileFormat, in_bytes: &[u8], out_fd: i32);
+        fn compress_to_vec(format: FileFormat, in_bytes: &[u8], out: &mut Vec<u8>) -> bool;
         fn decompress_bytes(format: FileFormat, in_bytes: &[u8], out_fd: i32);
+        fn decompress_bytes_quiet(format: FileFormat, in_bytes: &[u8], out_fd: i32) -> String;
         fn fmt2name(fmt: FileFormat) -> *const c_char;
         fn fmt_compressed(fmt: FileFormat) -> bool;
         fn fmt_compressed_any(fmt: FileFormat) -> bool;
+        fn thread_count() -> usize;
+        fn set_worker_threads(n: usize);
+        fn ramdisk_auto_enabled() -> bool;
+        fn compress_ramdisk_auto(
+            fallback: FileFormat,
+            in_bytes: &[u8],
+            out: &mut Vec<u8>,
+        ) -> FileFormat;
+        fn patch_ramdisk(
+            format: FileFormat,
+            in_bytes: &[u8],
+            cmds: &Vec<String>,
+            out: &mut Vec<u8>,
+        ) -> bool;
 
         #[cxx_name = "sign_payload"]
         fn sign_payload_for_cxx(payload: &[u8]) -> Vec<u8>;
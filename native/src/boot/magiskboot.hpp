@@ -29,6 +29,7 @@
 #define LZ4_LEG_MAGIC   "\x02\x21\x4c\x18"
 #define LZ41_MAGIC      "\x03\x21\x4c\x18"
 #define LZ42_MAGIC      "\x04\x22\x4d\x18"
+#define ZSTD_MAGIC      "\x28\xb5\x2f\xfd"
 #define MTK_MAGIC       "\x88\x16\x88\x58"
 #define DTB_MAGIC       "\xd0\x0d\xfe\xed"
 #define LG_BUMP_MAGIC   "\x41\xa9\xe4\x67\x74\x4d\x1d\x1b\xa4\x29\xf2\xec\xea\x65\x52\x79"
@@ -52,7 +53,8 @@
 enum class FileFormat : uint8_t;
 
 int unpack(Utf8CStr image, bool skip_decomp = false, bool hdr = false);
-void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp = false);
+bool repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp = false);
+int patch_image(Utf8CStr src_img, Utf8CStr out_img, const rust::Vec<rust::String> &cmds);
 int split_image_dtb(Utf8CStr filename, bool skip_decomp = false);
 void cleanup();
 FileFormat check_fmt(const void *buf, size_t len);
@@ -0,0 +1,147 @@
+use std::cell::Cell;
+use std::cmp::{max, min};
+use std::env;
+use std::num::NonZeroUsize;
+use std::sync::Mutex;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
+
+// Number of worker threads, 0 means not yet determined
+static THREAD_COUNT: AtomicUsize = AtomicUsize::new(0);
+
+thread_local! {
+    // Share of the threads given to a worker of a pool, 0 if not in a pool
+    static WORKER_THREADS: Cell<usize> = const { Cell::new(0) };
+}
+
+pub fn thread_count() -> usize {
+    let n = WORKER_THREADS.get();
+    if n != 0 {
+        return n;
+    }
+    let n = THREAD_COUNT.load(Ordering::Relaxed);
+    if n != 0 {
+        return n;
+    }
+    let n = env::var("MAGISKBOOT_THREADS")
+        .ok()
+        .and_then(|s| s.parse::<usize>().ok())
+        .filter(|n| *n > 0)
+        .unwrap_or_else(|| {
+            thread::available_parallelism()
+                .map(NonZeroUsize::get)
+                .unwrap_or(1)
+        });
+    THREAD_COUNT.store(n, Ordering::Relaxed);
+    n
+}
+
+pub(crate) fn set_thread_count(n: usize) {
+    if n > 0 {
+        THREAD_COUNT.store(n, Ordering::Relaxed);
+    }
+}
+
+// The threads of a pool are shared out evenly between its workers, so that
+// nested pools never run more threads than the outermost one.
+fn worker_share(workers: usize) -> usize {
+    max(thread_count() / workers, 1)
+}
+
+// Called by every worker of a pool started outside of Rust
+pub fn set_worker_threads(n: usize) {
+    WORKER_THREADS.set(n);
+}
+
+// Run f as if it were a worker of a pool with a share of n threads
+pub(crate) fn with_worker_threads<R, F: FnOnce() -> R>(n: usize, f: F) -> R {
+    let saved = WORKER_THREADS.replace(n);
+    let r = f();
+    WORKER_THREADS.set(saved);
+    r
+}
+
+// Run f on every item with a pool of scoped worker threads.
+// The results are returned in the same order as the items.
+pub(crate) fn par_map<T, R, F>(items: &[T], f: F) -> Vec<R>
+where
+    T: Sync,
+    R: Send,
+    F: Fn(&T) -> R + Sync,
+{
+    par_map_workers(thread_count(), items, f)
+}
+
+// Same as par_map, but with at most the given number of worker threads
+pub(crate) fn par_map_workers<T, R, F>(workers: usize, items: &[T], f: F) -> Vec<R>
+where
+    T: Sync,
+    R: Send,
+    F: Fn(&T) -> R + Sync,
+{
+    let workers = min(workers, items.len());
+    if workers <= 1 {
+        return items.iter().map(f).collect();
+    }
+
+    let share = worker_share(workers);
+    let next = AtomicUsize::new(0);
+    let mut results: Vec<Option<R>> = Vec::with_capacity(items.len());
+    results.resize_with(items.len(), || None);
+
+    thread::scope(|s| {
+        let handles: Vec<_> = (0..workers)
+            .map(|_| {
+                s.spawn(|| {
+                    set_worker_threads(share);
+                    let mut done = Vec::new();
+                    loop {
+                        let i = next.fetch_add(1, Ordering::Relaxed);
+                        if i >= items.len() {
+                            break;
+                        }
+                        done.push((i, f(&items[i])));
+                    }
+                    done
+                })
+            })
+            .collect();
+        for handle in handles {
+            for (i, r) in handle.join().unwrap() {
+                results[i] = Some(r);
+            }
+        }
+    });
+
+    results.into_iter().map(Option::unwrap).collect()
+}
+
+// Run f on every item with a pool of scoped worker threads, each item is
+// handed out to exactly one worker so that it can be modified in place.
+pub(crate) fn par_for_each_mut<T, F>(items: &mut [T], f: F)
+where
+    T: Send,
+    F: Fn(&mut T) + Sync,
+{
+    let workers = min(thread_count(), items.len());
+    if workers <= 1 {
+        items.iter_mut().for_each(f);
+        return;
+    }
+
+    let share = worker_share(workers);
+    let iter = Mutex::new(items.iter_mut());
+    thread::scope(|s| {
+        for _ in 0..workers {
+            s.spawn(|| {
+                set_worker_threads(share);
+                loop {
+                    let Some(item) = iter.lock().unwrap().next() else {
+                        break;
+                    };
+                    f(item);
+                }
+            });
+        }
+    });
+}
@@ -1,13 +1,21 @@
 use crate::compress::get_decoder;
-use crate::ffi::check_fmt;
-use crate::proto::update_metadata::DeltaArchiveManifest;
+use crate::ffi::{FileFormat, check_fmt};
+use crate::parallel::par_map;
 use crate::proto::update_metadata::mod_InstallOperation::Type;
-use base::{LoggedError, LoggedResult, ReadSeekExt, ResultExt, WriteExt, error};
+use crate::proto::update_metadata::{
+    DeltaArchiveManifest, Extent, InstallOperation, PartitionUpdate,
+};
+use base::{LoggedError, LoggedResult, MappedFile, ReadExt, ResultExt, WriteExt, error, log_err};
+use brotli_decompressor::Decompressor;
 use byteorder::{BigEndian, ReadBytesExt};
 use quick_protobuf::{BytesReader, MessageRead};
-use std::fs::File;
-use std::io::{BufReader, Cursor, Read, Seek, SeekFrom, Write};
-use std::os::fd::FromRawFd;
+use sha2::{Digest, Sha256};
+use std::borrow::Cow;
+use std::fs::{self, File};
+use std::io::{BufReader, BufWriter, Error, Read, Seek, SeekFrom, Write};
+use std::os::fd::{AsFd, FromRawFd};
+use std::os::unix::fs::{FileExt, MetadataExt};
+use std::path::Path;
 
 macro_rules! bad_payload {
     ($msg:literal) => {{
@@ -22,16 +30,446 @@ macro_rules! bad_payload {
 
 const PAYLOAD_MAGIC: &str = "CrAU";
 
+// Magic, version, manifest length and manifest signature length
+const PAYLOAD_HEADER_SIZE: u64 = 24;
+
+// OTA zips store payload.bin uncompressed, so it can be read in place
+const ZIP_LOCAL_MAGIC: u32 = 0x04034b50;
+const ZIP_CD_MAGIC: u32 = 0x02014b50;
+const ZIP_EOCD_MAGIC: u32 = 0x06054b50;
+const ZIP64_LOCATOR_MAGIC: u32 = 0x07064b50;
+const ZIP64_EOCD_MAGIC: u32 = 0x06064b50;
+const ZIP_LOCAL_SIZE: usize = 30;
+const ZIP_CD_SIZE: usize = 46;
+const ZIP_EOCD_SIZE: usize = 22;
+const ZIP64_LOCATOR_SIZE: usize = 20;
+const ZIP64_EOCD_SIZE: usize = 56;
+const ZIP64_EXTRA_ID: u16 = 1;
+const ZIP_STORED: u16 = 0;
+const PAYLOAD_ENTRY: &[u8] = b"payload.bin";
+
+// Decoded data is gathered into writes of this size
+const WRITE_BUF_SIZE: usize = 0x100000;
+
+// Patches of SOURCE_BSDIFF and BROTLI_BSDIFF operations. The header has the
+// magic, then the control block size, diff block size and new data size.
+// BSDIFF40 blocks are always bzip2 compressed, BSDF2 has the compression of
+// each block after the magic.
+const BSDIFF_MAGIC: &[u8] = b"BSDIFF40";
+const BSDF2_MAGIC: &[u8] = b"BSDF2";
+const BSDIFF_HEADER_SIZE: usize = 32;
+const BSPATCH_CHUNK: usize = 0x10000;
+
+// Writes a stream of data across the destination extents of an operation.
+// Operations never share destination blocks, so they can be written with
+// positioned writes from multiple threads.
+struct ExtentWriter<'a> {
+    file: &'a File,
+    extents: &'a [Extent],
+    block_size: u64,
+    // Bytes already written to the current extent
+    pos: u64,
+}
+
+impl Write for ExtentWriter<'_> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        loop {
+            let Some(ext) = self.extents.first() else {
+                return Err(Error::other("data exceeds the destination extents"));
+            };
+            let len = ext.num_blocks.unwrap_or(0) * self.block_size;
+            if self.pos == len {
+                self.extents = &self.extents[1..];
+                self.pos = 0;
+                continue;
+            }
+            let offset = ext.start_block.unwrap_or(0) * self.block_size + self.pos;
+            let n = buf.len().min((len - self.pos) as usize);
+            self.file.write_all_at(&buf[..n], offset)?;
+            self.pos += n as u64;
+            return Ok(n);
+        }
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        Ok(())
+    }
+}
+
+fn extents_size(extents: &[Extent], block_size: u64) -> LoggedResult<u64> {
+    let mut size = 0;
+    for ext in extents {
+        ext.start_block
+            .ok_or_else(|| bad_payload!("start block not found"))?;
+        size += ext
+            .num_blocks
+            .ok_or_else(|| bad_payload!("num blocks not found"))?
+            * block_size;
+    }
+    Ok(size)
+}
+
+// Sign-magnitude integers of bsdiff patches
+fn offtin(b: &[u8]) -> i64 {
+    let v = u64::from_le_bytes(b[..8].try_into().unwrap());
+    let n = (v & !(1 << 63)) as i64;
+    if v >> 63 != 0 { -n } else { n }
+}
+
+fn bsdiff_block<'a>(compression: u8, data: &'a [u8]) -> LoggedResult<Box<dyn Read + 'a>> {
+    match compression {
+        0 => Ok(Box::new(data)),
+        1 => Ok(get_decoder(FileFormat::BZIP2, data)),
+        2 => Ok(Box::new(Decompressor::new(data, BSPATCH_CHUNK))),
+        _ => Err(bad_payload!("unknown patch compression: {}", compression)),
+    }
+}
+
+// Apply a bsdiff patch to old, the new data is written to out
+fn bspatch<W: Write>(old: &[u8], patch: &[u8], out: &mut W) -> LoggedResult<()> {
+    if patch.len() < BSDIFF_HEADER_SIZE {
+        return Err(bad_payload!("patch too small"));
+    }
+    let compression = if patch.starts_with(BSDIFF_MAGIC) {
+        [1, 1, 1]
+    } else if patch.starts_with(BSDF2_MAGIC) {
+        [patch[5], patch[6], patch[7]]
+    } else {
+        return Err(bad_payload!("invalid patch magic"));
+    };
+    let ctrl_len = offtin(&patch[8..]);
+    let diff_len = offtin(&patch[16..]);
+    let new_size = offtin(&patch[24..]);
+    let blocks = &patch[BSDIFF_HEADER_SIZE..];
+    if ctrl_len < 0
+        || diff_len < 0
+        || new_size < 0
+        || ctrl_len.saturating_add(diff_len) > blocks.len() as i64
+    {
+        return Err(bad_payload!("corrupted patch header"));
+    }
+    let (ctrl, blocks) = blocks.split_at(ctrl_len as usize);
+    let (diff, extra) = blocks.split_at(diff_len as usize);
+    let mut ctrl = bsdiff_block(compression[0], ctrl)?;
+    let mut diff = bsdiff_block(compression[1], diff)?;
+    let mut extra = bsdiff_block(compression[2], extra)?;
+
+    let mut buf = vec![0u8; BSPATCH_CHUNK];
+    let mut new_pos = 0_i64;
+    let mut old_pos = 0_i64;
+    let mut triple = [0u8; 24];
+    while new_pos < new_size {
+        // Add x bytes of diff to the old data, copy y bytes of extra data,
+        // then move in the old data by z bytes
+        ctrl.read_exact(&mut triple)?;
+        let x = offtin(&triple[0..]);
+        let y = offtin(&triple[8..]);
+        let z = offtin(&triple[16..]);
+        if x < 0 || y < 0 || x.saturating_add(y) > new_size - new_pos {
+            return Err(bad_payload!("corrupted patch"));
+        }
+
+        let mut left = x as usize;
+        while left > 0 {
+            let n = left.min(buf.len());
+            diff.read_exact(&mut buf[..n])?;
+            for (i, b) in buf[..n].iter_mut().enumerate() {
+                let pos = old_pos + i as i64;
+                if pos >= 0 && (pos as usize) < old.len() {
+                    *b = b.wrapping_add(old[pos as usize]);
+                }
+            }
+            out.write_all(&buf[..n])?;
+            old_pos += n as i64;
+            left -= n;
+        }
+
+        let mut left = y as usize;
+        while left > 0 {
+            let n = left.min(buf.len());
+            extra.read_exact(&mut buf[..n])?;
+            out.write_all(&buf[..n])?;
+            left -= n;
+        }
+
+        new_pos += x + y;
+        old_pos += z;
+    }
+    Ok(())
+}
+
+// The data of the source extents, borrowed from the source image if contiguous
+fn source_data<'a>(
+    operation: &InstallOperation,
+    source: Option<&'a [u8]>,
+    block_size: u64,
+) -> LoggedResult<Cow<'a, [u8]>> {
+    let Some(source) = source else {
+        return Err(bad_payload!("source image required for delta operations"));
+    };
+    let mut ranges: Vec<(usize, usize)> = Vec::with_capacity(operation.src_extents.len());
+    for ext in &operation.src_extents {
+        let start = ext
+            .start_block
+            .ok_or_else(|| bad_payload!("start block not found"))?
+            * block_size;
+        let end = start
+            + ext
+                .num_blocks
+                .ok_or_else(|| bad_payload!("num blocks not found"))?
+                * block_size;
+        if end > source.len() as u64 {
+            return Err(bad_payload!("source extents exceed the source image"));
+        }
+        match ranges.last_mut() {
+            Some(last) if last.1 == start as usize => last.1 = end as usize,
+            _ => ranges.push((start as usize, end as usize)),
+        }
+    }
+    let data = match ranges.as_slice() {
+        [] => Cow::Borrowed(&source[..0]),
+        [(start, end)] => Cow::Borrowed(&source[*start..*end]),
+        _ => Cow::Owned(
+            ranges
+                .iter()
+                .flat_map(|r| &source[r.0..r.1])
+                .copied()
+                .collect(),
+        ),
+    };
+    if let Some(hash) = &operation.src_sha256_hash
+        && Sha256::digest(&data).as_slice() != hash.as_slice()
+    {
+        return Err(bad_payload!("source data mismatch, wrong source image?"));
+    }
+    Ok(data)
+}
+
+// An install operation, with the output and source image of its partition
+struct Job<'a> {
+    operation: &'a InstallOperation,
+    out_file: &'a File,
+    source: Option<&'a [u8]>,
+}
+
+fn apply_operation(job: &Job, data: &[u8], block_size: u64) -> LoggedResult<()> {
+    let operation = job.operation;
+    if operation.dst_extents.is_empty() {
+        return Err(bad_payload!("dst extents not found"));
+    }
+    let dst_size = extents_size(&operation.dst_extents, block_size)?;
+    let mut out = BufWriter::with_capacity(
+        WRITE_BUF_SIZE.min(dst_size as usize),
+        ExtentWriter {
+            file: job.out_file,
+            extents: &operation.dst_extents,
+            block_size,
+            pos: 0,
+        },
+    );
+
+    match operation.type_pb {
+        Type::REPLACE => out.write_all(data)?,
+        Type::ZERO | Type::DISCARD => out.write_zeros(dst_size as usize)?,
+        Type::REPLACE_BZ | Type::REPLACE_XZ => {
+            let fmt = check_fmt(data);
+            let mut decoder = get_decoder(fmt, data);
+            let Ok(_): std::io::Result<()> = (try {
+                std::io::copy(decoder.as_mut(), &mut out)?;
+            }) else {
+                return Err(bad_payload!("decompression failed"));
+            };
+        }
+        Type::SOURCE_COPY => {
+            out.write_all(&source_data(operation, job.source, block_size)?)?;
+        }
+        Type::SOURCE_BSDIFF | Type::BROTLI_BSDIFF => {
+            let old = source_data(operation, job.source, block_size)?;
+            bspatch(&old, data, &mut out)?;
+        }
+        t => return Err(bad_payload!("unsupported operation type: {:?}", t)),
+    };
+    out.flush()?;
+    Ok(())
+}
+
+fn data_range(operation: &InstallOperation) -> LoggedResult<(u64, usize)> {
+    let data_len = operation.data_length.unwrap_or(0) as usize;
+    if data_len == 0 {
+        return Ok((0, 0));
+    }
+    let data_offset = operation
+        .data_offset
+        .ok_or_else(|| bad_payload!("data offset not found"))?;
+    Ok((data_offset, data_len))
+}
+
+fn le16(b: &[u8], off: usize) -> u16 {
+    u16::from_le_bytes([b[off], b[off + 1]])
+}
+
+fn le32(b: &[u8], off: usize) -> u32 {
+    u32::from_le_bytes(b[off..off + 4].try_into().unwrap())
+}
+
+fn le64(b: &[u8], off: usize) -> u64 {
+    u64::from_le_bytes(b[off..off + 8].try_into().unwrap())
+}
+
+// Offset of the data of payload.bin in an OTA zip, found through the central directory
+fn zip_payload_offset(file: &File) -> LoggedResult<u64> {
+    let size = file.metadata()?.len();
+    // The end of central directory record is followed by a comment of at most 64K
+    let tail_len = size.min((ZIP_EOCD_SIZE + 0xffff) as u64) as usize;
+    let mut tail = vec![0; tail_len];
+    file.read_exact_at(&mut tail, size - tail_len as u64)?;
+    let eocd = (0..=tail_len.saturating_sub(ZIP_EOCD_SIZE))
+        .rev()
+        .find(|&i| i + ZIP_EOCD_SIZE <= tail_len && le32(&tail, i) == ZIP_EOCD_MAGIC)
+        .ok_or_else(|| bad_payload!("zip central directory not found"))?;
+
+    let mut cd_size = le32(&tail, eocd + 12) as u64;
+    let mut cd_offset = le32(&tail, eocd + 16) as u64;
+    if eocd >= ZIP64_LOCATOR_SIZE && le32(&tail, eocd - ZIP64_LOCATOR_SIZE) == ZIP64_LOCATOR_MAGIC {
+        let mut eocd64 = [0u8; ZIP64_EOCD_SIZE];
+        file.read_exact_at(&mut eocd64, le64(&tail, eocd - ZIP64_LOCATOR_SIZE + 8))?;
+        if le32(&eocd64, 0) != ZIP64_EOCD_MAGIC {
+            return Err(bad_payload!("invalid zip64 end of central directory"));
+        }
+        cd_size = le64(&eocd64, 40);
+        cd_offset = le64(&eocd64, 48);
+    }
+    // Both come from the file, the directory has to fit in it before allocating
+    if cd_offset.checked_add(cd_size).is_none_or(|end| end > size) {
+        return Err(bad_payload!("invalid zip central directory"));
+    }
+
+    let mut cd = vec![0; cd_size as usize];
+    file.read_exact_at(&mut cd, cd_offset)?;
+    let mut pos = 0;
+    while pos + ZIP_CD_SIZE <= cd.len() && le32(&cd, pos) == ZIP_CD_MAGIC {
+        let name_len = le16(&cd, pos + 28) as usize;
+        let extra_len = le16(&cd, pos + 30) as usize;
+        let comment_len = le16(&cd, pos + 32) as usize;
+        let name_start = pos + ZIP_CD_SIZE;
+        let next = name_start + name_len + extra_len + comment_len;
+        if next > cd.len() {
+            break;
+        }
+        if &cd[name_start..name_start + name_len] != PAYLOAD_ENTRY {
+            pos = next;
+            continue;
+        }
+        if le16(&cd, pos + 10) != ZIP_STORED {
+            return Err(bad_payload!("payload.bin is compressed in the zip"));
+        }
+
+        // Sizes and offsets that don't fit in 32 bits are in the zip64 extra field,
+        // in this order, and only if the 32 bit field is saturated
+        let mut fields = [
+            le32(&cd, pos + 24) as u64,
+            le32(&cd, pos + 20) as u64,
+            le32(&cd, pos + 42) as u64,
+        ];
+        let mut extra = &cd[name_start + name_len..name_start + name_len + extra_len];
+        while extra.len() >= 4 {
+            let len = (le16(extra, 2) as usize + 4).min(extra.len());
+            if le16(extra, 0) == ZIP64_EXTRA_ID {
+                let mut off = 4;
+                for field in fields.iter_mut().filter(|f| **f == u32::MAX as u64) {
+                    if off + 8 > len {
+                        break;
+                    }
+                    *field = le64(extra, off);
+                    off += 8;
+                }
+            }
+            extra = &extra[len..];
+        }
+        let local_offset = fields[2];
+
+        let mut local = [0u8; ZIP_LOCAL_SIZE];
+        file.read_exact_at(&mut local, local_offset)?;
+        if le32(&local, 0) != ZIP_LOCAL_MAGIC {
+            return Err(bad_payload!("invalid zip local header"));
+        }
+        return Ok(local_offset
+            + ZIP_LOCAL_SIZE as u64
+            + le16(&local, 26) as u64
+            + le16(&local, 28) as u64);
+    }
+    Err(bad_payload!("payload.bin not found in zip"))
+}
+
+fn same_file(a: &str, b: &str) -> bool {
+    match (fs::metadata(a), fs::metadata(b)) {
+        (Ok(a), Ok(b)) => a.dev() == b.dev() && a.ino() == b.ino(),
+        _ => false,
+    }
+}
+
+// Source images of delta payloads are mapped, operations read their extents in place
+fn open_source(path: &str) -> LoggedResult<MappedFile> {
+    let file = File::open(path).log_with_msg(|w| write!(w, "Cannot open '{path}'"))?;
+    // The metadata of block devices, like the partition of the current slot, has no size
+    let len = (&file).seek(SeekFrom::End(0))? as usize;
+    if len == 0 {
+        return log_err!("Empty source image '{}'", path);
+    }
+    Ok(MappedFile::create(file.as_fd(), len, false)?)
+}
+
+// Create the output of a partition, preallocated so that operations can be
+// written in any order
+fn create_output(partition: &PartitionUpdate, path: &str, block_size: u64) -> LoggedResult<File> {
+    eprintln!("Extracting [{}] to [{}]", partition.partition_name, path);
+    let file = File::create(path).log_with_msg(|w| write!(w, "Cannot write to '{path}'"))?;
+    let mut size = partition
+        .new_partition_info
+        .as_ref()
+        .and_then(|info| info.size)
+        .unwrap_or(0);
+    for operation in &partition.operations {
+        for ext in &operation.dst_extents {
+            let end = ext.start_block.unwrap_or(0) + ext.num_blocks.unwrap_or(0);
+            size = size.max(end * block_size);
+        }
+    }
+    if file.metadata()?.is_file() {
+        file.set_len(size)?;
+    }
+    Ok(file)
+}
+
+// partition_name can be a comma separated list of partitions or "all", out_path
+// is then a directory where each partition is extracted to '[partition].img'.
+// source is the source image of a delta payload, or with multiple partitions, a
+// directory of '[partition].img' source images.
 pub fn extract_boot_from_payload(
     in_path: &str,
     partition_name: Option<&str>,
     out_path: Option<&str>,
+    source: Option<&str>,
 ) -> LoggedResult<()> {
-    let mut reader = BufReader::new(if in_path == "-" {
+    // STDIN can only be read sequentially
+    let in_std = in_path == "-";
+    let in_file = if in_std {
         unsafe { File::from_raw_fd(0) }
     } else {
         File::open(in_path).log_with_msg(|w| write!(w, "Cannot open '{in_path}'"))?
-    });
+    };
+    let mut reader = BufReader::new(&in_file);
+
+    // Offset of payload.bin in the input, which is non-zero in OTA zips
+    let mut base = 0;
+    if !in_std {
+        let mut magic = [0u8; 4];
+        in_file.read_exact_at(&mut magic, 0)?;
+        if u32::from_le_bytes(magic) == ZIP_LOCAL_MAGIC {
+            base = zip_payload_offset(&in_file)?;
+            reader.seek(SeekFrom::Start(base))?;
+        }
+    }
 
     let buf = &mut [0u8; 4];
     reader.read_exact(buf)?;
@@ -63,15 +501,15 @@ pub fn extract_boot_from_payload(
         let mut br = BytesReader::from_bytes(manifest);
         DeltaArchiveManifest::from_reader(&mut br, manifest)?
     };
-    if manifest.get_minor_version() != 0 {
+    if manifest.get_minor_version() != 0 && source.is_none() {
         return Err(bad_payload!(
-            "delta payloads are not supported, please use a full payload file"
+            "delta payload, the source image must be specified with -s"
         ));
     }
 
     let block_size = manifest.get_block_size() as u64;
 
-    let partition = match partition_name {
+    let partitions: Vec<&PartitionUpdate> = match partition_name {
         None => {
             let boot = manifest
                 .partitions
@@ -84,95 +522,128 @@ pub fn extract_boot_from_payload(
                     .iter()
                     .find(|p| p.partition_name == "boot"),
             };
-            boot.ok_or_else(|| bad_payload!("boot partition not found"))?
+            vec![boot.ok_or_else(|| bad_payload!("boot partition not found"))?]
         }
-        Some(name) => manifest
-            .partitions
-            .iter()
-            .find(|p| p.partition_name.as_str() == name)
-            .ok_or_else(|| bad_payload!("partition '{}' not found", name))?,
-    };
-
-    let out_str: String;
-    let out_path = match out_path {
-        None => {
-            out_str = format!("{}.img", partition.partition_name);
-            out_str.as_str()
+        Some("all") => manifest.partitions.iter().collect(),
+        Some(names) => {
+            let mut partitions = Vec::new();
+            for name in names.split(',').filter(|s| !s.is_empty()) {
+                let partition = manifest
+                    .partitions
+                    .iter()
+                    .find(|p| p.partition_name.as_str() == name)
+                    .ok_or_else(|| bad_payload!("partition '{}' not found", name))?;
+                if !partitions.iter().any(|p| std::ptr::eq(*p, partition)) {
+                    partitions.push(partition);
+                }
+            }
+            partitions
         }
-        Some(s) => s,
     };
 
-    let mut out_file =
-        File::create(out_path).log_with_msg(|w| write!(w, "Cannot write to '{out_path}'"))?;
-
-    // Skip the manifest signature
-    reader.skip(manifest_sig_len as usize)?;
-
-    // Sort the install operations with data_offset so we will only ever need to seek forward
-    // This makes it possible to support non-seekable input file descriptors
-    let mut operations = partition.operations.clone();
-    operations.sort_by_key(|e| e.data_offset.unwrap_or(0));
-    let mut curr_data_offset: u64 = 0;
-
-    for operation in operations.iter() {
-        let data_len = operation
-            .data_length
-            .ok_or_else(|| bad_payload!("data length not found"))? as usize;
-
-        let data_offset = operation
-            .data_offset
-            .ok_or_else(|| bad_payload!("data offset not found"))?;
+    if partitions.is_empty() {
+        return Err(bad_payload!("no partition to extract"));
+    }
+    // Partition names are used as file names, so they must not lead anywhere else
+    for p in &partitions {
+        let name = p.partition_name.as_str();
+        if name.is_empty() || name == "." || name == ".." || name.contains(['/', '\0']) {
+            return Err(bad_payload!(
+                "invalid partition name '{}'",
+                name.escape_debug()
+            ));
+        }
+    }
 
-        let data_type = operation.type_pb;
+    let multiple = partition_name.is_some_and(|s| s == "all" || s.contains(','));
+    let (out_paths, src_paths): (Vec<String>, Vec<Option<String>>) = if multiple {
+        let dir = out_path.unwrap_or(".");
+        fs::create_dir_all(dir).log_with_msg(|w| write!(w, "Cannot create '{dir}'"))?;
+        partitions
+            .iter()
+            .map(|p| {
+                let name = &p.partition_name;
+                // Partitions without a source image are new in the target build
+                let src = source
+                    .map(|src| format!("{src}/{name}.img"))
+                    .filter(|src| Path::new(src).exists());
+                (format!("{dir}/{name}.img"), src)
+            })
+            .unzip()
+    } else {
+        let path = match out_path {
+            None => format!("{}.img", partitions[0].partition_name),
+            Some(s) => s.to_string(),
+        };
+        (vec![path], vec![source.map(str::to_string)])
+    };
 
-        buf.resize(data_len, 0u8);
-        let data = &mut buf[..data_len];
+    let mut sources = Vec::with_capacity(partitions.len());
+    for (out, src) in out_paths.iter().zip(&src_paths) {
+        sources.push(match src {
+            Some(src) => {
+                if same_file(src, out) {
+                    return log_err!("Cannot extract over the source image '{}'", src);
+                }
+                Some(open_source(src)?)
+            }
+            None => None,
+        });
+    }
+    let mut outputs = Vec::with_capacity(partitions.len());
+    for (partition, path) in partitions.iter().zip(&out_paths) {
+        outputs.push(create_output(partition, path, block_size)?);
+    }
 
-        // Skip to the next offset and read data
-        let skip = data_offset - curr_data_offset;
-        reader.skip(skip as usize)?;
-        reader.read_exact(data)?;
-        curr_data_offset = data_offset + data_len as u64;
+    // The operations of all partitions are handled in a single sweep over the data blobs.
+    // Sort them with data_offset so we will only ever need to seek forward.
+    // This makes it possible to support non-seekable input file descriptors.
+    let mut jobs: Vec<Job> = partitions
+        .iter()
+        .zip(&outputs)
+        .zip(&sources)
+        .flat_map(|((p, out_file), source)| {
+            p.operations.iter().map(move |operation| Job {
+                operation,
+                out_file,
+                source: source.as_ref().map(AsRef::as_ref),
+            })
+        })
+        .collect();
+    jobs.sort_by_key(|job| job.operation.data_offset.unwrap_or(0));
 
-        let out_offset = operation
-            .dst_extents
-            .first()
-            .ok_or_else(|| bad_payload!("dst extents not found"))?
-            .start_block
-            .ok_or_else(|| bad_payload!("start block not found"))?
-            * block_size;
+    if in_std {
+        // Skip the manifest signature
+        reader.skip(manifest_sig_len as usize)?;
 
-        match data_type {
-            Type::REPLACE => {
-                out_file.seek(SeekFrom::Start(out_offset))?;
-                out_file.write_all(data)?;
-            }
-            Type::ZERO => {
-                for ext in operation.dst_extents.iter() {
-                    let out_seek = ext
-                        .start_block
-                        .ok_or_else(|| bad_payload!("start block not found"))?
-                        * block_size;
-                    let num_blocks = ext
-                        .num_blocks
-                        .ok_or_else(|| bad_payload!("num blocks not found"))?;
-                    out_file.seek(SeekFrom::Start(out_seek))?;
-                    out_file.write_zeros(num_blocks as usize)?;
-                }
+        let mut curr_data_offset: u64 = 0;
+        for job in &jobs {
+            let (data_offset, data_len) = data_range(job.operation)?;
+            buf.resize(data_len, 0u8);
+            let data = &mut buf[..data_len];
+            if data_len > 0 {
+                // Skip to the next offset and read data
+                let skip = data_offset
+                    .checked_sub(curr_data_offset)
+                    .ok_or_else(|| bad_payload!("overlapping data blobs"))?;
+                reader.skip(skip as usize)?;
+                reader.read_exact(data)?;
+                curr_data_offset = data_offset + data_len as u64;
             }
-            Type::REPLACE_BZ | Type::REPLACE_XZ => {
-                out_file.seek(SeekFrom::Start(out_offset))?;
-                let fmt = check_fmt(data);
-
-                let mut decoder = get_decoder(fmt, Cursor::new(data));
-                let Ok(_): std::io::Result<()> = (try {
-                    std::io::copy(decoder.as_mut(), &mut out_file)?;
-                }) else {
-                    return Err(bad_payload!("decompression failed"));
-                };
-            }
-            _ => return Err(bad_payload!("unsupported operation type")),
-        };
+            apply_operation(job, data, block_size)?;
+        }
+    } else {
+        // Operations write disjoint extents and only read the source image, so they are
+        // applied on worker threads. Each worker only holds the data of the operation
+        // it is working on.
+        let data_start = base + PAYLOAD_HEADER_SIZE + manifest_len as u64 + manifest_sig_len as u64;
+        let results = par_map(&jobs, |job| -> LoggedResult<()> {
+            let (data_offset, data_len) = data_range(job.operation)?;
+            let mut data = vec![0u8; data_len];
+            in_file.read_exact_at(&mut data, data_start + data_offset)?;
+            apply_operation(job, &data, block_size)
+        });
+        results.into_iter().collect::<LoggedResult<()>>()?;
     }
 
     Ok(())
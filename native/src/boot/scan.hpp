@@ -0,0 +1,192 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Locate candidates of several magic numbers in a single pass over a buffer.
+// Only the first 2 bytes of each magic are compared, so the caller has to
+// verify each candidate (e.g. with check_fmt) before using it.
+class magic_scanner {
+public:
+    static constexpr size_t MAX_MAGICS = 8;
+
+    // Every magic has to be at least 2 bytes long
+    magic_scanner(std::initializer_list<const char *> magics) : num(0) {
+        for (const char *m : magics) {
+            if (num == MAX_MAGICS)
+                break;
+            b0[num] = m[0];
+            b1[num] = m[1];
+            ++num;
+        }
+    }
+
+    // Return the first candidate within [begin, end), or end if not found
+    const uint8_t *find(const uint8_t *begin, const uint8_t *end) const {
+        const uint8_t *p = begin;
+#if defined(__AVX2__)
+        __m256i v0[MAX_MAGICS], v1[MAX_MAGICS];
+        for (size_t i = 0; i < num; ++i) {
+            v0[i] = _mm256_set1_epi8(static_cast<char>(b0[i]));
+            v1[i] = _mm256_set1_epi8(static_cast<char>(b1[i]));
+        }
+        for (; end - p > 32; p += 32) {
+            __m256i c0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+            __m256i c1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 1));
+            __m256i m = _mm256_setzero_si256();
+            for (size_t i = 0; i < num; ++i) {
+                m = _mm256_or_si256(m, _mm256_and_si256(
+                        _mm256_cmpeq_epi8(c0, v0[i]), _mm256_cmpeq_epi8(c1, v1[i])));
+            }
+            if (auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(m)))
+                return p + __builtin_ctz(mask);
+        }
+#elif defined(__SSE2__)
+        __m128i v0[MAX_MAGICS], v1[MAX_MAGICS];
+        for (size_t i = 0; i < num; ++i) {
+            v0[i] = _mm_set1_epi8(static_cast<char>(b0[i]));
+            v1[i] = _mm_set1_epi8(static_cast<char>(b1[i]));
+        }
+        for (; end - p > 16; p += 16) {
+            __m128i c0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            __m128i c1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1));
+            __m128i m = _mm_setzero_si128();
+            for (size_t i = 0; i < num; ++i) {
+                m = _mm_or_si128(m, _mm_and_si128(
+                        _mm_cmpeq_epi8(c0, v0[i]), _mm_cmpeq_epi8(c1, v1[i])));
+            }
+            if (auto mask = static_cast<uint32_t>(_mm_movemask_epi8(m)))
+                return p + __builtin_ctz(mask);
+        }
+#elif defined(__ARM_NEON)
+        uint8x16_t v0[MAX_MAGICS], v1[MAX_MAGICS];
+        for (size_t i = 0; i < num; ++i) {
+            v0[i] = vdupq_n_u8(b0[i]);
+            v1[i] = vdupq_n_u8(b1[i]);
+        }
+        for (; end - p > 16; p += 16) {
+            uint8x16_t c0 = vld1q_u8(p);
+            uint8x16_t c1 = vld1q_u8(p + 1);
+            uint8x16_t m = vdupq_n_u8(0);
+            for (size_t i = 0; i < num; ++i) {
+                m = vorrq_u8(m, vandq_u8(vceqq_u8(c0, v0[i]), vceqq_u8(c1, v1[i])));
+            }
+            // Narrow each byte of the mask into a nibble
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                    vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+            if (mask)
+                return p + (__builtin_ctzll(mask) >> 2);
+        }
+#endif
+        // Scalar fallback and tail handling
+        for (; end - p > 1; ++p) {
+            for (size_t i = 0; i < num; ++i) {
+                if (p[0] == b0[i] && p[1] == b1[i])
+                    return p;
+            }
+        }
+        return end;
+    }
+
+private:
+    uint8_t b0[MAX_MAGICS];
+    uint8_t b1[MAX_MAGICS];
+    size_t num;
+};
+
+struct [[gnu::packed]] fdt_header {
+    struct fdt32_t {
+        uint32_t byte0: 8;
+        uint32_t byte1: 8;
+        uint32_t byte2: 8;
+        uint32_t byte3: 8;
+
+        constexpr operator uint32_t() const {
+            return std::bit_cast<uint32_t>(fdt32_t {
+                .byte0 = byte3,
+                .byte1 = byte2,
+                .byte2 = byte1,
+                .byte3 = byte0
+            });
+        }
+    };
+
+    struct node_header {
+        fdt32_t tag;
+        char name[0];
+    };
+
+    fdt32_t magic;			 /* magic word FDT_MAGIC */
+    fdt32_t totalsize;		 /* total size of DT block */
+    fdt32_t off_dt_struct;		 /* offset to structure */
+    fdt32_t off_dt_strings;		 /* offset to strings */
+    fdt32_t off_mem_rsvmap;		 /* offset to memory reserve map */
+    fdt32_t version;		 /* format version */
+    fdt32_t last_comp_version;	 /* last compatible version */
+
+    /* version 2 fields below */
+    fdt32_t boot_cpuid_phys;	 /* Which physical CPU id we're
+					    booting on */
+    /* version 3 fields below */
+    fdt32_t size_dt_strings;	 /* size of the strings block */
+
+    /* version 17 fields below */
+    fdt32_t size_dt_struct;		 /* size of the structure block */
+};
+
+// Locate every flattened device tree within a buffer, e.g. the DTBs appended
+// to a kernel. All candidates of the FDT magic are collected in a single pass,
+// then validated together. Returns the offsets of the DTBs in ascending order.
+inline std::vector<size_t> find_dtbs(const uint8_t *buf, size_t sz) {
+    const uint8_t * const end = buf + sz;
+    const magic_scanner scanner = { "\xd0\x0d\xfe\xed" };
+
+    std::vector<size_t> candidates;
+    for (auto p = scanner.find(buf, end); p < end; p = scanner.find(p + 1, end)) {
+        if (static_cast<size_t>(end - p) >= sizeof(fdt_header) && memcmp(p, "\xd0\x0d\xfe\xed", 4) == 0)
+            candidates.push_back(p - buf);
+    }
+
+    std::vector<size_t> dtbs;
+    // Candidates before this offset are within a header or a DTB already found
+    size_t next = 0;
+    for (size_t off : candidates) {
+        if (off < next)
+            continue;
+        auto fdt_hdr = reinterpret_cast<const fdt_header *>(buf + off);
+        size_t avail = sz - off;
+        next = off + sizeof(fdt_header);
+
+        // Check that fdt_header.totalsize does not overflow the buffer or is empty dtb
+        // https://github.com/torvalds/linux/commit/7b937cc243e5b1df8780a0aa743ce800df6c68d1
+        uint32_t totalsize = fdt_hdr->totalsize;
+        if (totalsize > avail || totalsize <= 0x48)
+            continue;
+
+        // Check that fdt_header.off_dt_struct does not overflow the buffer
+        uint32_t off_dt_struct = fdt_hdr->off_dt_struct;
+        if (off_dt_struct > avail - sizeof(fdt_header::node_header))
+            continue;
+
+        // Check that fdt_node_header.tag of first node is FDT_BEGIN_NODE
+        auto fdt_node_hdr = reinterpret_cast<const fdt_header::node_header *>(buf + off + off_dt_struct);
+        if (fdt_node_hdr->tag != 0x1u)
+            continue;
+
+        dtbs.push_back(off);
+        next = off + totalsize;
+    }
+    return dtbs;
+}
@@ -0,0 +1,307 @@
+use crate::parallel::{par_map, thread_count};
+use base::{LoggedResult, MappedFile, ResultExt, Utf8CStr, log_err};
+use byteorder::{BigEndian, ReadBytesExt, WriteBytesExt};
+use sha2::{Digest, Sha256};
+use std::fs::File;
+use std::io::{Read, Seek, SeekFrom, Write};
+use std::ops::Range;
+
+// dm-verity hash tree with an AVB hashtree footer, compatible with
+// `avbtool add_hashtree_footer --hash_algorithm sha256`.
+//
+// Image layout after the footer is added:
+//
+// | image | padding | hash tree | vbmeta | padding | ... | footer |
+//
+// Every block of a level is hashed independently, so each level is split
+// into ranges of blocks that are hashed on worker threads.
+
+const DIGEST_SIZE: usize = 32;
+const AVB_FOOTER_MAGIC: &[u8] = b"AVBf";
+const AVB_FOOTER_SIZE: usize = 64;
+const AVB_MAGIC: &[u8] = b"AVB0";
+const AVB_VBMETA_HEADER_SIZE: usize = 256;
+const AVB_HASHTREE_DESCRIPTOR_TAG: u64 = 1;
+const AVB_HASHTREE_DESCRIPTOR_SIZE: usize = 180;
+const RELEASE_STRING: &str = "magiskboot";
+
+fn round_up(n: usize, align: usize) -> usize {
+    n.div_ceil(align) * align
+}
+
+// Size of every level of the tree, from the bottom level up
+fn level_sizes(image_size: usize, block_size: usize) -> Vec<usize> {
+    let mut sizes = Vec::new();
+    let mut size = image_size;
+    while size > block_size {
+        let level = round_up(size.div_ceil(block_size) * DIGEST_SIZE, block_size);
+        sizes.push(level);
+        size = level;
+    }
+    sizes
+}
+
+// Hash every block of src, the last block is zero padded
+fn hash_level(src: &[u8], block_size: usize, salted: &Sha256) -> Vec<u8> {
+    let num_blocks = src.len().div_ceil(block_size);
+    let mut out = vec![0_u8; round_up(num_blocks * DIGEST_SIZE, block_size)];
+
+    let hash_blocks = |blocks: &Range<usize>| {
+        let mut digests = Vec::with_capacity(blocks.len() * DIGEST_SIZE);
+        for i in blocks.clone() {
+            let block = &src[i * block_size..((i + 1) * block_size).min(src.len())];
+            let mut h = salted.clone();
+            h.update(block);
+            if block.len() < block_size {
+                h.update(vec![0_u8; block_size - block.len()]);
+            }
+            digests.extend_from_slice(&h.finalize());
+        }
+        digests
+    };
+
+    // A few ranges per thread to balance the load
+    let step = num_blocks.div_ceil(thread_count() * 4).max(1);
+    let ranges: Vec<Range<usize>> = (0..num_blocks)
+        .step_by(step)
+        .map(|i| i..(i + step).min(num_blocks))
+        .collect();
+    let mut off = 0;
+    for digests in par_map(&ranges, hash_blocks) {
+        out[off..off + digests.len()].copy_from_slice(&digests);
+        off += digests.len();
+    }
+    out
+}
+
+// Returns the root digest and the tree, with the top level first
+fn hash_tree(image: &[u8], block_size: usize, salt: &[u8]) -> (Vec<u8>, Vec<u8>) {
+    let mut salted = Sha256::new();
+    salted.update(salt);
+
+    let mut levels = Vec::new();
+    let mut top = hash_level(image, block_size, &salted);
+    for _ in 1..level_sizes(image.len(), block_size).len() {
+        let next = hash_level(&top, block_size, &salted);
+        levels.push(top);
+        top = next;
+    }
+
+    let mut h = salted;
+    h.update(&top);
+    let root = h.finalize().to_vec();
+
+    let mut tree = top;
+    for level in levels.iter().rev() {
+        tree.extend_from_slice(level);
+    }
+    (root, tree)
+}
+
+struct Hashtree<'a> {
+    image_size: u64,
+    tree_offset: u64,
+    tree_size: u64,
+    block_size: u32,
+    name: &'a str,
+    salt: &'a [u8],
+    root_digest: &'a [u8],
+}
+
+impl Hashtree<'_> {
+    fn descriptor(&self) -> std::io::Result<Vec<u8>> {
+        let following = AVB_HASHTREE_DESCRIPTOR_SIZE - 16
+            + self.name.len()
+            + self.salt.len()
+            + self.root_digest.len();
+        let padded = round_up(following, 8);
+
+        let mut d = Vec::with_capacity(16 + padded);
+        d.write_u64::<BigEndian>(AVB_HASHTREE_DESCRIPTOR_TAG)?;
+        d.write_u64::<BigEndian>(padded as u64)?;
+        // dm-verity version
+        d.write_u32::<BigEndian>(1)?;
+        d.write_u64::<BigEndian>(self.image_size)?;
+        d.write_u64::<BigEndian>(self.tree_offset)?;
+        d.write_u64::<BigEndian>(self.tree_size)?;
+        // Data and hash block size
+        d.write_u32::<BigEndian>(self.block_size)?;
+        d.write_u32::<BigEndian>(self.block_size)?;
+        // No FEC: number of roots, offset, size
+        d.write_u32::<BigEndian>(0)?;
+        d.write_u64::<BigEndian>(0)?;
+        d.write_u64::<BigEndian>(0)?;
+        let mut alg = [0_u8; 32];
+        alg[..6].copy_from_slice(b"sha256");
+        d.write_all(&alg)?;
+        d.write_u32::<BigEndian>(self.name.len() as u32)?;
+        d.write_u32::<BigEndian>(self.salt.len() as u32)?;
+        d.write_u32::<BigEndian>(self.root_digest.len() as u32)?;
+        // Flags and reserved
+        d.write_u32::<BigEndian>(0)?;
+        d.write_all(&[0_u8; 60])?;
+        d.write_all(self.name.as_bytes())?;
+        d.write_all(self.salt)?;
+        d.write_all(self.root_digest)?;
+        d.resize(16 + padded, 0);
+        Ok(d)
+    }
+
+    // An unsigned vbmeta image with the hashtree descriptor as its only descriptor
+    fn vbmeta(&self) -> std::io::Result<Vec<u8>> {
+        let desc = self.descriptor()?;
+        let aux_size = round_up(desc.len(), 64);
+
+        let mut v = Vec::with_capacity(AVB_VBMETA_HEADER_SIZE + aux_size);
+        v.write_all(AVB_MAGIC)?;
+        // Required libavb version 1.0
+        v.write_u32::<BigEndian>(1)?;
+        v.write_u32::<BigEndian>(0)?;
+        // Authentication and auxiliary block size
+        v.write_u64::<BigEndian>(0)?;
+        v.write_u64::<BigEndian>(aux_size as u64)?;
+        // Algorithm NONE, then the offset and size of the hash, signature,
+        // public key and public key metadata, which are all empty
+        v.write_u32::<BigEndian>(0)?;
+        v.write_all(&[0_u8; 64])?;
+        // Descriptors offset and size
+        v.write_u64::<BigEndian>(0)?;
+        v.write_u64::<BigEndian>(desc.len() as u64)?;
+        // Rollback index, flags and rollback index location
+        v.write_u64::<BigEndian>(0)?;
+        v.write_u32::<BigEndian>(0)?;
+        v.write_u32::<BigEndian>(0)?;
+        let mut release = [0_u8; 48];
+        release[..RELEASE_STRING.len()].copy_from_slice(RELEASE_STRING.as_bytes());
+        v.write_all(&release)?;
+        v.resize(AVB_VBMETA_HEADER_SIZE, 0);
+        v.extend_from_slice(&desc);
+        v.resize(AVB_VBMETA_HEADER_SIZE + aux_size, 0);
+        Ok(v)
+    }
+}
+
+fn footer(original_size: u64, vbmeta_offset: u64, vbmeta_size: u64) -> std::io::Result<Vec<u8>> {
+    let mut f = Vec::with_capacity(AVB_FOOTER_SIZE);
+    f.write_all(AVB_FOOTER_MAGIC)?;
+    // Footer version 1.0
+    f.write_u32::<BigEndian>(1)?;
+    f.write_u32::<BigEndian>(0)?;
+    f.write_u64::<BigEndian>(original_size)?;
+    f.write_u64::<BigEndian>(vbmeta_offset)?;
+    f.write_u64::<BigEndian>(vbmeta_size)?;
+    f.resize(AVB_FOOTER_SIZE, 0);
+    Ok(f)
+}
+
+// Size of the image without an existing AVB footer and everything it describes
+fn original_size(file: &mut File) -> std::io::Result<u64> {
+    let size = file.seek(SeekFrom::End(0))?;
+    if size < AVB_FOOTER_SIZE as u64 {
+        return Ok(size);
+    }
+    file.seek(SeekFrom::End(-(AVB_FOOTER_SIZE as i64)))?;
+    let mut magic = [0_u8; 4];
+    file.read_exact(&mut magic)?;
+    if magic != AVB_FOOTER_MAGIC {
+        return Ok(size);
+    }
+    file.seek(SeekFrom::Current(8))?;
+    let original = file.read_u64::<BigEndian>()?;
+    Ok(original.min(size))
+}
+
+fn parse_hex(s: &str) -> Option<Vec<u8>> {
+    if s.len() % 2 != 0 {
+        return None;
+    }
+    (0..s.len())
+        .step_by(2)
+        .map(|i| u8::from_str_radix(s.get(i..i + 2)?, 16).ok())
+        .collect()
+}
+
+fn random_salt() -> std::io::Result<Vec<u8>> {
+    let mut salt = vec![0_u8; DIGEST_SIZE];
+    File::open("/dev/urandom")?.read_exact(&mut salt)?;
+    Ok(salt)
+}
+
+pub(crate) fn hashtree_cmd(
+    img: &Utf8CStr,
+    name: &str,
+    salt: Option<&str>,
+    block_size: usize,
+    partition_size: u64,
+) -> LoggedResult<()> {
+    if !block_size.is_power_of_two() || block_size < 512 {
+        return log_err!("Invalid block size: {}", block_size);
+    }
+    let salt = match salt {
+        Some(s) => match parse_hex(s) {
+            Some(salt) => salt,
+            None => return log_err!("Invalid salt: {}", s),
+        },
+        None => random_salt()?,
+    };
+
+    let mut file = File::options().read(true).write(true).open(img.as_str())?;
+    // Any previous footer is replaced, the tree is always built from the original image
+    let original = original_size(&mut file)?;
+    if original == 0 {
+        return log_err!("Empty image");
+    }
+
+    let image_size = round_up(original as usize, block_size) as u64;
+    let (root, tree) = {
+        let map = MappedFile::open(img)?;
+        hash_tree(&map.as_ref()[..original as usize], block_size, &salt)
+    };
+
+    let ht = Hashtree {
+        image_size,
+        tree_offset: image_size,
+        tree_size: tree.len() as u64,
+        block_size: block_size as u32,
+        name,
+        salt: &salt,
+        root_digest: &root,
+    };
+    let vbmeta = ht.vbmeta()?;
+    let vbmeta_offset = image_size + tree.len() as u64;
+    let vbmeta_end = vbmeta_offset + round_up(vbmeta.len(), block_size) as u64;
+    let footer_offset = if partition_size == 0 {
+        vbmeta_end
+    } else {
+        if partition_size % block_size as u64 != 0 {
+            return log_err!("Partition size must be a multiple of {}", block_size);
+        }
+        if vbmeta_end + block_size as u64 > partition_size {
+            return log_err!(
+                "Image with hash tree needs {} bytes, over the partition size {}",
+                vbmeta_end + block_size as u64,
+                partition_size
+            );
+        }
+        partition_size - block_size as u64
+    };
+
+    // The padding after the image and the vbmeta image is left as a hole
+    file.set_len(original)?;
+    file.set_len(image_size)?;
+    file.seek(SeekFrom::Start(image_size))?;
+    file.write_all(&tree)?;
+    file.write_all(&vbmeta)?;
+    file.set_len(footer_offset + block_size as u64)?;
+    file.seek(SeekFrom::Start(
+        footer_offset + (block_size - AVB_FOOTER_SIZE) as u64,
+    ))?;
+    file.write_all(&footer(original, vbmeta_offset, vbmeta.len() as u64)?)?;
+    file.sync_all().log_ok();
+
+    let hex = |v: &[u8]| v.iter().map(|b| format!("{b:02x}")).collect::<String>();
+    eprintln!("Hash tree: {} bytes at offset {}", tree.len(), image_size);
+    println!("ROOT_DIGEST={}", hex(&root));
+    println!("SALT={}", hex(&salt));
+    Ok(())
+}
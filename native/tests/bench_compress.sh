@@ -0,0 +1,54 @@
+#!/usr/bin/env bash
+#
+# Compare the single-threaded and multi-threaded encoders of magiskboot
+#
+# Usage: bench_compress.sh <magiskboot> <infile> [threads] [format...]
+#
+# Every format is compressed with '-j 1' (the serial encoder) and '-j <threads>',
+# and both outputs are verified by decompressing them again.
+
+set -e
+
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 <magiskboot> <infile> [threads] [format...]" >&2
+  exit 1
+fi
+
+MAGISKBOOT=$(realpath "$1")
+INFILE=$(realpath "$2")
+THREADS=${3:-$(nproc)}
+shift $(($# < 3 ? $# : 3))
+FORMATS=${*:-gzip zopfli xz lz4 lz4_legacy zstd}
+
+TMPDIR=$(mktemp -d)
+trap 'rm -rf "$TMPDIR"' EXIT
+
+now() {
+  date +%s.%N
+}
+
+# $1 = format, $2 = threads
+run() {
+  local out="$TMPDIR/out.$1.$2"
+  local start end
+  start=$(now)
+  "$MAGISKBOOT" compress="$1" -j "$2" "$INFILE" "$out" 2>/dev/null
+  end=$(now)
+  "$MAGISKBOOT" decompress "$out" "$TMPDIR/dec" 2>/dev/null
+  if ! cmp -s "$INFILE" "$TMPDIR/dec"; then
+    echo "! $1 -j $2: decompressed data does not match" >&2
+    exit 1
+  fi
+  awk -v fmt="$1" -v j="$2" -v start="$start" -v end="$end" \
+    -v in_sz="$(stat -c %s "$INFILE")" -v out_sz="$(stat -c %s "$out")" 'BEGIN {
+      t = end - start
+      printf "%-12s -j %-3d %9.3f s %9.2f MB/s %12d bytes (%.2f%%)\n",
+        fmt, j, t, in_sz / t / 1048576, out_sz, out_sz * 100 / in_sz
+    }'
+}
+
+echo "Input: $INFILE ($(stat -c %s "$INFILE") bytes)"
+for fmt in $FORMATS; do
+  run "$fmt" 1
+  run "$fmt" "$THREADS"
+done
@@ -0,0 +1,144 @@
+/*
+ * Throughput benchmark for the appended DTB locator
+ *
+ * Build on host:
+ *   c++ -O2 -std=c++20 native/tests/bench_dtb.cpp -o bench_dtb
+ *   c++ -O2 -std=c++20 -mavx2 native/tests/bench_dtb.cpp -o bench_dtb_avx2
+ *
+ * Usage: bench_dtb [rounds] [kernel...]
+ *
+ * Each kernel is a zImage/Image with DTBs appended (e.g. Image.gz-dtb, or the
+ * kernel section of a boot image). Without any kernels, a synthetic 32 MiB
+ * kernel with 4 appended DTBs is used.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../src/boot/scan.hpp"
+
+using namespace std;
+
+#define DTB_MAGIC "\xd0\x0d\xfe\xed"
+
+// The previous approach: memmem for the magic, validate, repeat.
+// Only the first DTB is located.
+static int find_dtb_offset(const uint8_t *buf, unsigned sz) {
+    const uint8_t * const end = buf + sz;
+
+    for (auto curr = buf; curr < end; curr += sizeof(fdt_header)) {
+        curr = static_cast<uint8_t*>(memmem(curr, end - curr, DTB_MAGIC, sizeof(fdt_header::fdt32_t)));
+        if (curr == nullptr)
+            return -1;
+
+        auto fdt_hdr = reinterpret_cast<const fdt_header *>(curr);
+        uint32_t totalsize = fdt_hdr->totalsize;
+        if (totalsize > end - curr || totalsize <= 0x48)
+            continue;
+        uint32_t off_dt_struct = fdt_hdr->off_dt_struct;
+        if (off_dt_struct > end - curr)
+            continue;
+        auto fdt_node_hdr = reinterpret_cast<const fdt_header::node_header *>(curr + off_dt_struct);
+        if (fdt_node_hdr->tag != 0x1u)
+            continue;
+
+        return curr - buf;
+    }
+    return -1;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    v = __builtin_bswap32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+// A kernel-like blob with stray FDT magics and a few DTBs at its end
+static vector<uint8_t> synthetic_kernel(size_t size, int num_dtbs) {
+    const size_t dtb_sz = 128 * 1024;
+    vector<uint8_t> buf(size + num_dtbs * dtb_sz);
+    mt19937_64 rng(0x6474625f62656e63ULL);
+    for (auto &b : buf)
+        b = static_cast<uint8_t>(rng());
+    // Stray magics that fail validation
+    for (int i = 0; i < 256; ++i)
+        memcpy(buf.data() + rng() % (size - 64), DTB_MAGIC, 4);
+    for (int i = 0; i < num_dtbs; ++i) {
+        uint8_t *dtb = buf.data() + size + i * dtb_sz;
+        memcpy(dtb, DTB_MAGIC, 4);
+        put_be32(dtb + 4, dtb_sz);   // totalsize
+        put_be32(dtb + 8, 0x38);     // off_dt_struct
+        put_be32(dtb + 0x38, 1);     // FDT_BEGIN_NODE
+    }
+    return buf;
+}
+
+template <typename Fn>
+static double bench(const char *name, Fn &&fn, const vector<vector<uint8_t>> &corpus, int rounds) {
+    size_t total = 0;
+    for (auto &k : corpus)
+        total += k.size();
+    double best = 1e30;
+    for (int i = 0; i < rounds; ++i) {
+        auto start = chrono::steady_clock::now();
+        for (auto &k : corpus)
+            fn(k);
+        chrono::duration<double> d = chrono::steady_clock::now() - start;
+        if (d.count() < best)
+            best = d.count();
+    }
+    double mbps = total / best / (1024 * 1024);
+    printf("%-10s %10.2f MB/s\n", name, mbps);
+    return mbps;
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+
+    vector<vector<uint8_t>> corpus;
+    for (int i = 2; i < argc; ++i) {
+        ifstream in(argv[i], ios::binary);
+        if (!in) {
+            fprintf(stderr, "! Cannot open %s\n", argv[i]);
+            return 1;
+        }
+        corpus.emplace_back(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    if (corpus.empty())
+        corpus.push_back(synthetic_kernel(32 << 20, 4));
+
+    size_t total = 0;
+    for (auto &k : corpus)
+        total += k.size();
+    printf("Locating DTBs in %zu kernel(s), %zu bytes, best of %d rounds\n",
+           corpus.size(), total, rounds);
+
+    // Both have to agree on the first DTB of every kernel
+    for (size_t i = 0; i < corpus.size(); ++i) {
+        auto &k = corpus[i];
+        int expect = find_dtb_offset(k.data(), k.size());
+        auto dtbs = find_dtbs(k.data(), k.size());
+        int actual = dtbs.empty() ? -1 : static_cast<int>(dtbs[0]);
+        printf("kernel %zu: %zu DTB(s), first at %d\n", i, dtbs.size(), actual);
+        if (expect != actual) {
+            fprintf(stderr, "! Locator results do not match (expected %d)\n", expect);
+            return 1;
+        }
+    }
+
+    volatile size_t sink = 0;
+    double base = bench("memmem", [&](const vector<uint8_t> &k) {
+        sink = sink + find_dtb_offset(k.data(), k.size());
+    }, corpus, rounds);
+    double vec = bench("find_dtbs", [&](const vector<uint8_t> &k) {
+        sink = sink + find_dtbs(k.data(), k.size()).size();
+    }, corpus, rounds);
+    printf("speedup    %10.2fx\n", vec / base);
+    return 0;
+}
@@ -0,0 +1,535 @@
+#!/usr/bin/env python3
+"""
+Benchmark harness for magiskboot
+
+Generates a reproducible corpus of synthetic images, then times magiskboot
+operations on them and reports the throughput and peak RSS of each one.
+
+Corpus (only needs the Python standard library):
+- boot images with header v0, v1, v2, v3 and v4
+- vendor boot images with header v3 and v4 (multiple vendor ramdisks)
+- DHTB, ChromeOS and MTK wrapped boot images
+- a file with multiple DTBs, a large dtbo-like file with many DTBs, and a
+  full OTA payload.bin
+
+Usage:
+    bench_magiskboot.py [options] <magiskboot>
+
+For more options: bench_magiskboot.py --help
+
+The same seed and sizes always generate byte-identical images, so results
+from different builds of magiskboot can be compared directly. With
+--baseline, every operation also runs on a second build and the speedup and
+peak RSS ratio against it are reported.
+"""
+import argparse
+import gzip
+import hashlib
+import lzma
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+from pathlib import Path
+
+MB = 1024 * 1024
+# Bumped when the corpus changes, so that existing corpora are regenerated
+CORPUS_VERSION = 2
+
+DTB_FILES = ("dtbs.img", "dtbo.img")
+DEFAULT_FORMATS = "gzip xz lzma bzip2 lz4 lz4_legacy lz4_lg zstd"
+
+
+###################
+# Synthetic data
+###################
+
+
+class DataGen:
+    """Semi-compressible data, similar to kernels and ramdisk files"""
+
+    def __init__(self, seed: int):
+        self.rng = random.Random(seed)
+        words = [
+            bytes(self.rng.choices(range(0x61, 0x7B), k=self.rng.randint(2, 10)))
+            for _ in range(4096)
+        ]
+        text = b" ".join(self.rng.choices(words, k=256 * 1024))
+        noise = self.rng.randbytes(len(text))
+        # Half text, half noise, mixed in 4K blocks
+        self.pool = b"".join(
+            (text if self.rng.random() < 0.5 else noise)[i : i + 4096]
+            for i in range(0, len(text), 4096)
+        )
+
+    def bytes(self, size: int) -> bytes:
+        out = bytearray()
+        while len(out) < size:
+            off = self.rng.randrange(len(self.pool) - 65536)
+            out += self.pool[off : off + min(65536, size - len(out))]
+        return bytes(out)
+
+
+def align(data: bytes, page: int) -> bytes:
+    return data + bytes(-len(data) % page)
+
+
+def cpio_newc(entries: list) -> bytes:
+    """entries: (name, mode, data)"""
+    out = bytearray()
+
+    def add(ino, name, mode, data):
+        nonlocal out
+        name = name.encode() + b"\0"
+        out += b"070701" + b"".join(
+            b"%08x" % v
+            for v in (ino, mode, 0, 0, 1, 0, len(data), 0, 0, 0, 0, len(name), 0)
+        )
+        out += name
+        out += bytes(-len(out) % 4)
+        out += data
+        out += bytes(-len(out) % 4)
+
+    for i, (name, mode, data) in enumerate(entries):
+        add(300000 + i, name, mode, data)
+    add(0, "TRAILER!!!", 0o755, b"")
+    return bytes(out)
+
+
+def ramdisk_cpio(gen: DataGen, size: int) -> bytes:
+    entries = [
+        ("init", 0o100750, gen.bytes(min(size // 4, 2 * MB))),
+        ("fstab.bench", 0o100640, b"/dev/block/by-name/system /system ext4 ro wait,verify,avb\n"),
+        ("lib", 0o40755, b""),
+        ("lib/modules", 0o40755, b""),
+    ]
+    total = len(entries[0][2])
+    i = 0
+    while total < size:
+        data = gen.bytes(gen.rng.randint(4096, 256 * 1024))
+        entries.append((f"lib/modules/mod{i:04d}.ko", 0o100644, data))
+        total += len(data)
+        i += 1
+    entries.sort(key=lambda e: e[0])
+    return cpio_newc(entries)
+
+
+def fdt(gen: DataGen, model: str, blob_size: int = 16 * 1024, nodes: int = 0) -> bytes:
+    """A flattened device tree with an fstab entry, and optionally filler nodes"""
+    strings = bytearray()
+    offsets = {}
+
+    def string_off(name):
+        if name not in offsets:
+            offsets[name] = len(strings)
+            strings.extend(name.encode() + b"\0")
+        return offsets[name]
+
+    struct_blk = bytearray()
+
+    def begin(name):
+        struct_blk.extend(struct.pack(">I", 1) + align(name.encode() + b"\0", 4))
+
+    def prop(name, value: bytes):
+        struct_blk.extend(struct.pack(">III", 3, len(value), string_off(name)))
+        struct_blk.extend(align(value, 4))
+
+    def end():
+        struct_blk.extend(struct.pack(">I", 2))
+
+    begin("")
+    prop("model", model.encode() + b"\0")
+    prop("compatible", b"bench,board\0")
+    prop("blob", gen.bytes(blob_size))
+    for i in range(nodes):
+        begin(f"device@{i:x}")
+        prop("compatible", b"bench,device\0")
+        prop("reg", struct.pack(">II", i << 12, 0x1000))
+        prop("status", b"okay\0")
+        end()
+    for node in ("firmware", "android", "fstab", "system"):
+        begin(node)
+    prop("fsmgr_flags", b"wait,verify,avb\0")
+    for _ in range(4):
+        end()
+    end()
+    struct_blk.extend(struct.pack(">I", 9))
+
+    off_rsvmap = 40
+    off_struct = off_rsvmap + 16
+    off_strings = off_struct + len(struct_blk)
+    total = off_strings + len(strings)
+    hdr = struct.pack(
+        ">10I",
+        0xD00DFEED, total, off_struct, off_strings, off_rsvmap,
+        17, 16, 0, len(strings), len(struct_blk),
+    )
+    return hdr + bytes(16) + bytes(struct_blk) + bytes(strings)
+
+
+###################
+# Boot images
+###################
+
+
+def hdr_v0(kernel, ramdisk, second, page, version, extra=b""):
+    hdr = b"ANDROID!" + struct.pack(
+        "<10I", len(kernel), 0x10008000, len(ramdisk), 0x11000000,
+        len(second), 0x10F00000, 0x10000100, page, version, 0,
+    )
+    hdr += align(b"bench", 16) + bytes(512) + bytes(32) + bytes(1024)
+    return hdr + extra
+
+
+def boot_v0_2(gen: DataGen, version: int, kernel, ramdisk) -> bytes:
+    page = 2048 if version == 0 else 4096
+    second = b""
+    dtbo = gen.bytes(64 * 1024) if version >= 1 else b""
+    dtb = fdt(gen, "bench-v2") if version == 2 else b""
+    extra = b""
+    if version >= 1:
+        hdr_sz = 1648 if version == 1 else 1660
+        # Offset of recovery_dtbo, after header, kernel and ramdisk
+        dtbo_off = page + len(align(kernel, page)) + len(align(ramdisk, page))
+        extra = struct.pack("<IQI", len(dtbo), dtbo_off, hdr_sz)
+    if version == 2:
+        extra += struct.pack("<IQ", len(dtb), 0x11F00000)
+    hdr = hdr_v0(kernel, ramdisk, second, page, version, extra)
+    return b"".join(align(x, page) for x in (hdr, kernel, ramdisk, second, dtbo, dtb) if x)
+
+
+def boot_v3_4(version: int, kernel, ramdisk) -> bytes:
+    hdr = b"ANDROID!" + struct.pack(
+        "<4I4II", len(kernel), len(ramdisk), 0, 1580 if version == 3 else 1584,
+        0, 0, 0, 0, version,
+    )
+    hdr += bytes(1536)
+    if version == 4:
+        hdr += struct.pack("<I", 0)
+    return b"".join(align(x, 4096) for x in (hdr, kernel, ramdisk))
+
+
+def vendor_boot(gen: DataGen, version: int, ramdisks: list) -> bytes:
+    page = 4096
+    dtb = fdt(gen, "bench-vendor")
+    rd_section = b"".join(r for _, _, r in ramdisks)
+    hdr = b"VNDRBOOT" + struct.pack(
+        "<5I", version, page, 0x10008000, 0x11000000, len(rd_section)
+    )
+    hdr += bytes(2048) + struct.pack("<I", 0x10000100) + align(b"bench", 16)
+    hdr += struct.pack("<IIQ", 2112 if version == 3 else 2128, len(dtb), 0x11F00000)
+    table = b""
+    bootconfig = b""
+    if version == 4:
+        off = 0
+        for name, rd_type, r in ramdisks:
+            table += struct.pack("<3I", len(r), off, rd_type)
+            table += name.encode().ljust(32, b"\0") + bytes(64)
+            off += len(r)
+        bootconfig = b"androidboot.bench=1\n"
+        hdr += struct.pack("<4I", len(table), len(ramdisks), 108, len(bootconfig))
+    return b"".join(
+        align(x, page) for x in (hdr, rd_section, dtb, table, bootconfig) if x
+    )
+
+
+def mtk_wrap(data: bytes, name: str) -> bytes:
+    return struct.pack("<II", 0x58881688, len(data)) + name.encode().ljust(32, b"\0") + bytes(472) + data
+
+
+def dhtb_wrap(img: bytes) -> bytes:
+    payload = img + b"SEANDROIDENFORCE" + b"\xff" * 4
+    digest = hashlib.sha256(payload).digest().ljust(40, b"\0")
+    return b"DHTB\x01\0\0\0" + digest + struct.pack("<I", len(payload)) + bytes(460) + payload
+
+
+def chromeos_wrap(img: bytes) -> bytes:
+    return b"CHROMEOS".ljust(65536, b"\0") + img
+
+
+###################
+# OTA payload
+###################
+
+
+def varint(v: int) -> bytes:
+    out = bytearray()
+    while True:
+        b = v & 0x7F
+        v >>= 7
+        out.append(b | (0x80 if v else 0))
+        if not v:
+            return bytes(out)
+
+
+def pb_int(field: int, v: int) -> bytes:
+    return varint(field << 3) + varint(v)
+
+
+def pb_bytes(field: int, v: bytes) -> bytes:
+    return varint(field << 3 | 2) + varint(len(v)) + v
+
+
+def payload_bin(partitions: dict, chunk: int = 2 * MB) -> bytes:
+    """A full payload, each partition split into REPLACE_XZ/REPLACE operations"""
+    block_size = 4096
+    blobs = bytearray()
+    parts = b""
+    for name, img in partitions.items():
+        img = align(img, block_size)
+        ops = b""
+        for off in range(0, len(img), chunk):
+            data = img[off : off + chunk]
+            xz = lzma.compress(data, check=lzma.CHECK_CRC32, preset=6)
+            # Incompressible data is stored as is, like delta_generator does
+            op_type, blob = (8, xz) if len(xz) < len(data) else (0, data)
+            extent = pb_int(1, off // block_size) + pb_int(2, len(data) // block_size)
+            op = pb_int(1, op_type) + pb_int(2, len(blobs)) + pb_int(3, len(blob))
+            op += pb_bytes(6, extent) + pb_bytes(8, hashlib.sha256(blob).digest())
+            ops += pb_bytes(8, op)
+            blobs += blob
+        info = pb_int(1, len(img)) + pb_bytes(2, hashlib.sha256(img).digest())
+        parts += pb_bytes(13, pb_bytes(1, name.encode()) + pb_bytes(7, info) + ops)
+    manifest = pb_int(3, block_size) + pb_int(12, 0) + parts
+    signature = bytes(16)
+    return (
+        b"CrAU" + struct.pack(">QQI", 2, len(manifest), len(signature))
+        + manifest + signature + bytes(blobs)
+    )
+
+
+###################
+# Corpus
+###################
+
+
+def generate(out: Path, seed: int, kernel_mb: int, ramdisk_mb: int):
+    out.mkdir(parents=True, exist_ok=True)
+    gen = DataGen(seed)
+
+    def write(name, data):
+        (out / name).write_bytes(data)
+        print(f"  {name:<20} {len(data):>12} bytes")
+
+    # mtime=0 keeps the gzip output reproducible
+    kernel = gzip.compress(gen.bytes(kernel_mb * MB), mtime=0)
+    cpio = ramdisk_cpio(gen, ramdisk_mb * MB)
+    rd_gz = gzip.compress(cpio, mtime=0)
+    rd_xz = lzma.compress(cpio, check=lzma.CHECK_CRC32)
+    dtbs = b"".join(fdt(gen, f"bench-{i}") for i in range(8))
+
+    print(f"Generating corpus in {out} (seed {seed})")
+    write("boot_v0.img", boot_v0_2(gen, 0, kernel + dtbs, rd_gz))
+    write("boot_v1.img", boot_v0_2(gen, 1, kernel, rd_gz))
+    write("boot_v2.img", boot_v0_2(gen, 2, kernel, rd_xz))
+    write("boot_v3.img", boot_v3_4(3, kernel, rd_gz))
+    write("boot_v4.img", boot_v3_4(4, kernel, rd_gz))
+    vnd = [("", 1, rd_gz), ("dlkm", 3, gzip.compress(ramdisk_cpio(gen, ramdisk_mb * MB // 2), mtime=0))]
+    write("vendor_boot_v3.img", vendor_boot(gen, 3, vnd[:1]))
+    write("vendor_boot_v4.img", vendor_boot(gen, 4, vnd))
+    v0 = boot_v0_2(gen, 0, kernel, rd_gz)
+    write("dhtb.img", dhtb_wrap(v0))
+    write("chromeos.img", chromeos_wrap(v0))
+    mtk = hdr_v0(mtk_wrap(kernel, "KERNEL"), mtk_wrap(rd_gz, "ROOTFS"), b"", 2048, 0)
+    write("mtk.img", b"".join(align(x, 2048) for x in (mtk, mtk_wrap(kernel, "KERNEL"), mtk_wrap(rd_gz, "ROOTFS"))))
+    write("dtbs.img", dtbs)
+    # Like the dtb/dtbo partitions of SoCs supporting many boards
+    write("dtbo.img", b"".join(
+        fdt(gen, f"bench-board-{i}", 256 * 1024, 2000) for i in range(64)))
+    write("ramdisk.cpio", cpio)
+    write("payload.bin", payload_bin({"boot": (out / "boot_v3.img").read_bytes()}))
+    (out / ".complete").write_text(f"{CORPUS_VERSION} {seed} {kernel_mb} {ramdisk_mb}\n")
+
+
+###################
+# Benchmarks
+###################
+
+# The peak RSS of a process includes the memory of the process it was forked
+# from, so commands are forked from a minimal interpreter instead of this one,
+# which holds the corpus. It reports the time, peak RSS and exit code.
+SPAWN = """
+import os, sys, time
+start = time.perf_counter()
+pid = os.fork()
+if pid == 0:
+    null = os.open(os.devnull, os.O_WRONLY)
+    os.dup2(null, 1)
+    os.dup2(null, 2)
+    try:
+        os.execv(sys.argv[1], sys.argv[1:])
+    finally:
+        os._exit(127)
+_, status, usage = os.wait4(pid, 0)
+print(time.perf_counter() - start, usage.ru_maxrss, os.waitstatus_to_exitcode(status))
+"""
+
+
+class Runner:
+    def __init__(self, magiskboot: Path, rounds: int, env: dict, baseline: Path = None):
+        self.magiskboot = magiskboot
+        self.baseline = baseline
+        self.rounds = rounds
+        self.env = env
+        self.failed = 0
+        header = f"{'OPERATION':<34} {'INPUT':>10} {'TIME':>9} {'MB/s':>9} {'PEAK RSS':>10}"
+        if baseline:
+            header += f" {'SPEEDUP':>8} {'RSS':>6}"
+        print(header)
+
+    def run_once(self, exe: Path, args: list, cwd: Path):
+        proc = subprocess.run(
+            [sys.executable, "-S", "-c", SPAWN, exe, *map(str, args)], cwd=cwd, env=self.env,
+            stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True, check=True,
+        )
+        t, rss, code = proc.stdout.split()
+        return float(t), int(rss), int(code)
+
+    def measure(self, exe: Path, name: str, args: list, cwd: Path, prepare, ok_codes):
+        best, rss = None, 0
+        for _ in range(self.rounds):
+            if prepare:
+                prepare()
+            t, r, code = self.run_once(exe, args, cwd)
+            if code not in ok_codes:
+                self.failed += 1
+                print(f"{name:<34} failed with exit code {code} ({exe})")
+                return None
+            best = t if best is None else min(best, t)
+            rss = max(rss, r)
+        return best, rss
+
+    def bench(self, name: str, args: list, cwd: Path, input_size: int,
+              prepare=None, ok_codes=(0,)):
+        res = self.measure(self.magiskboot, name, args, cwd, prepare, ok_codes)
+        if res is None:
+            return
+        best, rss = res
+        mbps = input_size / best / MB
+        line = f"{name:<34} {input_size / MB:>8.2f}M {best:>8.3f}s {mbps:>9.2f} {rss / 1024:>8.1f}M"
+        if self.baseline:
+            base = self.measure(self.baseline, name, args, cwd, prepare, ok_codes)
+            if base is None:
+                return
+            line += f" {base[0] / best:>7.2f}x {rss / base[1]:>5.2f}x"
+        print(line)
+
+
+def run(args):
+    corpus = args.corpus
+    stamp = corpus / ".complete"
+    expect = f"{CORPUS_VERSION} {args.seed} {args.kernel_size} {args.ramdisk_size}\n"
+    if not stamp.exists() or stamp.read_text() != expect:
+        shutil.rmtree(corpus, ignore_errors=True)
+        generate(corpus, args.seed, args.kernel_size, args.ramdisk_size)
+    if args.gen_only:
+        return 0
+
+    env = dict(os.environ)
+    if args.threads:
+        env["MAGISKBOOT_THREADS"] = str(args.threads)
+    baseline = args.baseline.resolve() if args.baseline else None
+    r = Runner(args.magiskboot.resolve(), args.rounds, env, baseline)
+    work = corpus / "work"
+
+    def fresh_work():
+        shutil.rmtree(work, ignore_errors=True)
+        work.mkdir()
+
+    images = sorted(p.name for p in corpus.glob("*.img") if p.name not in DTB_FILES)
+    for img in images:
+        src = corpus / img
+        size = src.stat().st_size
+        r.bench(f"unpack {img}", ["unpack", src], work, size, prepare=fresh_work,
+                ok_codes=(0, 2, 3))
+        r.bench(f"repack {img}", ["repack", src, "new.img"], work, size)
+        r.bench(f"unpack -n {img}", ["unpack", "-n", src], work, size, prepare=fresh_work,
+                ok_codes=(0, 2, 3))
+        r.bench(f"repack -n {img}", ["repack", "-n", src, "new.img"], work, size)
+        r.bench(f"patch {img}", ["patch", src, "new.img", "mkdir 0750 overlay.d", "patch"],
+                work, size)
+        r.bench(f"sha1 {img}", ["sha1", src], work, size)
+
+    # cpio operations on the uncompressed ramdisk
+    cpio = corpus / "ramdisk.cpio"
+    size = cpio.stat().st_size
+
+    def fresh_cpio():
+        fresh_work()
+        shutil.copy(cpio, work / "ramdisk.cpio")
+        shutil.copy(cpio, work / "orig.cpio")
+
+    r.bench("cpio ls -r", ["cpio", "ramdisk.cpio", "ls -r"], work, size, prepare=fresh_cpio)
+    r.bench("cpio patch", ["cpio", "ramdisk.cpio", "patch"], work, size, prepare=fresh_cpio)
+    r.bench("cpio add+backup", ["cpio", "ramdisk.cpio", "add 0750 init orig.cpio",
+                                "backup orig.cpio"], work, size, prepare=fresh_cpio)
+    r.bench("cpio extract", ["cpio", "ramdisk.cpio", "extract"], work, size, prepare=fresh_cpio)
+    # Commands that only touch a few entries, dominated by loading the archive
+    r.bench("cpio exists", ["cpio", "ramdisk.cpio", "exists init"], work, size,
+            prepare=fresh_cpio)
+    r.bench("cpio test", ["cpio", "ramdisk.cpio", "test"], work, size, prepare=fresh_cpio)
+    r.bench("cpio extract init", ["cpio", "ramdisk.cpio", "extract init init"], work, size,
+            prepare=fresh_cpio)
+    r.bench("cpio rm+backup", ["cpio", "ramdisk.cpio", "rm fstab.bench", "backup orig.cpio"],
+            work, size, prepare=fresh_cpio)
+
+    # compress/decompress for each format
+    for fmt in args.formats.split():
+        out = work / f"ramdisk.{fmt}"
+        r.bench(f"compress={fmt}", [f"compress={fmt}", cpio, out], work, size, prepare=fresh_work)
+        r.bench(f"decompress {fmt}", ["decompress", out, work / "dec.cpio"], work, size)
+
+    # dtb actions, test and patch process the DTBs of a file on multiple threads
+    for name in DTB_FILES:
+        dtbs = corpus / name
+        size = dtbs.stat().st_size
+
+        def fresh_dtb():
+            fresh_work()
+            shutil.copy(dtbs, work / name)
+
+        suffix = "" if name == "dtbs.img" else f" {name}"
+        if name == "dtbs.img":
+            r.bench("dtb print", ["dtb", name, "print"], work, size, prepare=fresh_dtb)
+        r.bench(f"dtb test{suffix}", ["dtb", name, "test"], work, size, prepare=fresh_dtb,
+                ok_codes=(0, 1))
+        r.bench(f"dtb patch{suffix}", ["dtb", name, "patch"], work, size, prepare=fresh_dtb,
+                ok_codes=(0, 1))
+
+    # payload extraction
+    payload = corpus / "payload.bin"
+    r.bench("extract payload.bin", ["extract", payload, "boot", "boot.img"], work,
+            payload.stat().st_size, prepare=fresh_work)
+
+    shutil.rmtree(work, ignore_errors=True)
+    return 1 if r.failed else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="magiskboot benchmark harness")
+    parser.add_argument("magiskboot", type=Path, nargs="?", help="magiskboot executable")
+    parser.add_argument("-c", "--corpus", type=Path, default=Path("bench_corpus"),
+                        help="corpus directory (default: bench_corpus)")
+    parser.add_argument("-s", "--seed", type=int, default=1, help="corpus seed")
+    parser.add_argument("-k", "--kernel-size", type=int, default=16,
+                        help="uncompressed kernel size in MB (default: 16)")
+    parser.add_argument("-r", "--ramdisk-size", type=int, default=8,
+                        help="uncompressed ramdisk size in MB (default: 8)")
+    parser.add_argument("-n", "--rounds", type=int, default=3,
+                        help="runs per operation, the best time is reported")
+    parser.add_argument("-j", "--threads", type=int, help="set MAGISKBOOT_THREADS")
+    parser.add_argument("-f", "--formats", default=DEFAULT_FORMATS,
+                        help=f'compression formats (default: "{DEFAULT_FORMATS}")')
+    parser.add_argument("-b", "--baseline", type=Path,
+                        help="another magiskboot executable to compare against")
+    parser.add_argument("--gen-only", action="store_true", help="only generate the corpus")
+    args = parser.parse_args()
+    if args.magiskboot is None and not args.gen_only:
+        parser.error("magiskboot is required unless --gen-only is set")
+    sys.exit(run(args))
+
+
+if __name__ == "__main__":
+    main()